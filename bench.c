@@ -0,0 +1,612 @@
+/* rebench: time the matcher on realistic inputs, and check it against ICU.
+ *
+ *   rebench [-o results.json] < benches.txt
+ *
+ * Each <bench> entry names a pattern and a corpus, either a file or a
+ * string repeated to size, one copy per line:
+ *
+ *   <bench name="log" rgx="..." icu="..." file="access.log"/>
+ *   <bench name="gen" rgx="..." str="some text" repeat="100000"/>
+ *
+ * The corpus is split into lines, and each line is one record matched on
+ * its own, as a log scanner would. "icu" is the same pattern in ICU's
+ * syntax, when it differs. For both engines it reports time per record,
+ * MB/s of UTF-8 input, and p50/p99 record latency; for this one, also
+ * allocations per record and the peak RSS so far. Records where the two
+ * engines disagree on the match are counted as mismatches.
+ *
+ * A <scale> entry instead runs one input at doubling sizes, to see how
+ * the cost grows with the input:
+ *
+ *   <scale name="nest" rgx="..." str="(" mid="x" end=")" from="64" to="65536"/>
+ *
+ * The input is "str" repeated n times, then "mid", then "end" repeated n
+ * times, for n from "from" to "to". It fits the exponent k of time and of
+ * peak memory against input length (cost ~ length^k) and flags anything
+ * above linear. A size is skipped once a single match takes over a second.
+ */
+#include "regex.h"
+#include "bml.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <unicode/uregex.h>
+
+#define TOKMAX (64*1024)
+
+#define SCALE_LIMIT  (1000000000u) /* ns for one match before we stop growing */
+#define SCALE_SAMPLE (20000000u)   /* ns to spend on each size */
+#define SCALE_LINEAR (1.2)         /* exponents above this are flagged */
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+/* Allocation counting. The bench is linked with --wrap for these, which
+ * catches every call made from our own objects (not from ICU's library).
+ * "live" is signed: a few blocks (from libc's own strdup and the like) are
+ * freed through here without having been counted.
+ */
+static size_t nallocs;   /* atomic */
+static long long live;   /* atomic; bytes */
+static long long peak;   /* atomic; high-water mark of live */
+
+extern void * __real_malloc(size_t n);
+extern void * __real_calloc(size_t n, size_t m);
+extern void * __real_realloc(void * p, size_t n);
+extern void __real_free(void * p);
+
+static void
+mem_add(long long n)
+{
+  long long l = __atomic_add_fetch(&live, n, __ATOMIC_RELAXED);
+  long long p = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+  while (l > p && !__atomic_compare_exchange_n(&peak, &p, l, true,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+void *
+__wrap_malloc(size_t n)
+{
+  void * p = __real_malloc(n);
+  __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+  if (p) mem_add((long long)malloc_usable_size(p));
+  return p;
+}
+
+void *
+__wrap_calloc(size_t n, size_t m)
+{
+  void * p = __real_calloc(n, m);
+  __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+  if (p) mem_add((long long)malloc_usable_size(p));
+  return p;
+}
+
+void *
+__wrap_realloc(void * p, size_t n)
+{
+  long long old = p ? (long long)malloc_usable_size(p) : 0;
+  void * q = __real_realloc(p, n);
+  __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+  if (q) mem_add((long long)malloc_usable_size(q) - old);
+  return q;
+}
+
+void
+__wrap_free(void * p)
+{
+  if (p) mem_add(-(long long)malloc_usable_size(p));
+  __real_free(p);
+}
+
+/* start a new high-water mark; returns the bytes live now */
+static long long
+mem_mark(void)
+{
+  long long l = __atomic_load_n(&live, __ATOMIC_RELAXED);
+  __atomic_store_n(&peak, l, __ATOMIC_RELAXED);
+  return l;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int
+u64_cmp(const void * va, const void * vb)
+{
+  uint64_t a = *(const uint64_t *)va;
+  uint64_t b = *(const uint64_t *)vb;
+  return (a > b) - (a < b);
+}
+
+struct bench_s {
+  bool scale;  /* <scale> rather than <bench> */
+  char * name;
+  char * rgx;
+  char * icu;  /* null if the same as rgx */
+  char * file; /* or */
+  char * str;
+  size_t repeat;
+  char * mid;  /* <scale> only */
+  char * end;
+  size_t from, to;
+};
+
+struct result_s {
+  uint64_t ns;
+  uint64_t p50;
+  uint64_t p99;
+  size_t matches;
+};
+
+/* the corpus as UTF-16, cut into lines */
+struct corpus_s {
+  size_t bytes; /* UTF-8 size */
+  UChar * text;
+  size_t nrecords;
+  const UChar ** records;
+  size_t * lens;
+};
+
+static char *
+read_corpus(const struct bench_s * b, size_t * len)
+{
+  char * buf;
+  if (b->file) {
+    FILE * fp = fopen(b->file, "rb");
+    long n;
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (n < 0 || !(buf = malloc((size_t)n + 1))) { fclose(fp); return NULL; }
+    *len = fread(buf, 1, (size_t)n, fp);
+    fclose(fp);
+  } else {
+    size_t sl = b->str ? strlen(b->str) : 0;
+    size_t i;
+    if (!(buf = malloc((sl + 1) * b->repeat + 1))) return NULL;
+    for (i = 0; i < b->repeat; ++i) {
+      memcpy(buf + i * (sl + 1), b->str, sl);
+      buf[i * (sl + 1) + sl] = '\n';
+    }
+    *len = (sl + 1) * b->repeat;
+  }
+  buf[*len] = '\0';
+  return buf;
+}
+
+static void
+free_corpus(struct corpus_s * c)
+{
+  free(c->text);
+  free(c->records);
+  free(c->lens);
+}
+
+#define CONVERT_CHUNK  (1 << 30) /* bytes per u_strFromUTF8 call, which counts in int32_t */
+
+/* the UTF-8 in [src, src + len) onto the end of c->text, a chunk at a time,
+ * each cut before a character; c->text has room for len more */
+static bool
+convert_corpus(struct corpus_s * c, size_t * n, const char * src, size_t len)
+{
+  while (len > 0) {
+    UErrorCode uec = U_ZERO_ERROR;
+    int32_t got = 0;
+    size_t take = len;
+    if (take > CONVERT_CHUNK) {
+      take = CONVERT_CHUNK;
+      while (take > 0 && (src[take] & 0xC0) == 0x80) take--;
+      if (take == 0) take = CONVERT_CHUNK; /* not UTF-8 anyway */
+    }
+    u_strFromUTF8WithSub(c->text + *n, (int32_t)take, &got, src, (int32_t)take,
+                         0xFFFD, NULL, &uec);
+    if (U_FAILURE(uec)) return false;
+    *n += (size_t)got;
+    src += take;
+    len -= take;
+  }
+  return true;
+}
+
+static bool
+load_corpus(const struct bench_s * b, struct corpus_s * c)
+{
+  char * utf8;
+  size_t n = 0;
+  size_t i, start;
+
+  memset(c, 0, sizeof(*c));
+  if (!(utf8 = read_corpus(b, &c->bytes))) return false;
+  c->text = malloc((c->bytes + 1) * sizeof(UChar));
+  if (!c->text || !convert_corpus(c, &n, utf8, c->bytes)) {
+    free(utf8);
+    free_corpus(c);
+    return false;
+  }
+  free(utf8);
+  c->text[n] = 0;
+
+  c->nrecords = 0;
+  for (i = 0; i < n; ++i) if (c->text[i] == '\n') c->nrecords++;
+  if (n && c->text[n - 1] != '\n') c->nrecords++;
+  c->records = malloc((c->nrecords + 1) * sizeof(UChar *));
+  c->lens = malloc((c->nrecords + 1) * sizeof(size_t));
+  if (!c->records || !c->lens) {
+    free_corpus(c);
+    return false;
+  }
+  c->nrecords = 0;
+  for (i = start = 0; i <= n; ++i) {
+    if (i == n ? i > start : c->text[i] == '\n') {
+      c->records[c->nrecords] = c->text + start;
+      c->lens[c->nrecords] = i - start;
+      c->nrecords++;
+      start = i + 1;
+    }
+  }
+  return true;
+}
+
+static void
+finish(struct result_s * r, uint64_t * lat, size_t n)
+{
+  qsort(lat, n, sizeof(uint64_t), u64_cmp);
+  r->p50 = n ? lat[n * 50 / 100] : 0;
+  r->p99 = n ? lat[n * 99 / 100] : 0;
+}
+
+/* spans[i * 2] and [i * 2 + 1] are each record's match, or -1 */
+static bool
+run_rgx(rgx_prog * prog, const struct corpus_s * c, int32_t * spans,
+        struct result_s * r, size_t * allocs)
+{
+  uint64_t * lat = malloc((c->nrecords + 1) * sizeof(uint64_t));
+  UChar ** subs = malloc(rgx_group_count(prog) * 2 * sizeof(UChar *));
+  size_t i, a0;
+  if (!lat || !subs) return false;
+
+  memset(r, 0, sizeof(*r));
+  a0 = __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+  for (i = 0; i < c->nrecords; ++i) {
+    uint64_t t0 = now_ns();
+    bool m = rgx_exec(prog, c->records[i], c->lens[i], subs, rgx_group_count(prog) * 2);
+    lat[i] = now_ns() - t0;
+    r->ns += lat[i];
+    r->matches += m;
+    spans[i * 2] = m ? (int32_t)(subs[0] - c->records[i]) : -1;
+    spans[i * 2 + 1] = m ? (int32_t)(subs[1] - c->records[i]) : -1;
+  }
+  *allocs = __atomic_load_n(&nallocs, __ATOMIC_RELAXED) - a0;
+  finish(r, lat, c->nrecords);
+  free(lat);
+  free(subs);
+  return true;
+}
+
+static bool
+run_icu(const char * pattern, const struct corpus_s * c, const int32_t * spans,
+        struct result_s * r, size_t * mismatches)
+{
+  UErrorCode uec = U_ZERO_ERROR;
+  UParseError pe;
+  uint64_t * lat = malloc((c->nrecords + 1) * sizeof(uint64_t));
+  URegularExpression * re;
+  UChar upat[TOKMAX];
+  size_t i;
+  if (!lat) return false;
+
+  u_strFromUTF8(upat, TOKMAX, NULL, pattern, -1, &uec);
+  re = uregex_open(upat, -1, 0, &pe, &uec);
+  if (U_FAILURE(uec)) { free(lat); return false; }
+  memset(r, 0, sizeof(*r));
+  *mismatches = 0;
+  for (i = 0; i < c->nrecords; ++i) {
+    uint64_t t0 = now_ns();
+    int32_t s = -1, e = -1;
+    bool m;
+    uregex_setText(re, c->records[i], (int32_t)c->lens[i], &uec);
+    m = uregex_find(re, 0, &uec);
+    if (m) { s = uregex_start(re, 0, &uec); e = uregex_end(re, 0, &uec); }
+    lat[i] = now_ns() - t0;
+    r->ns += lat[i];
+    r->matches += m;
+    if (s != spans[i * 2] || e != spans[i * 2 + 1]) (*mismatches)++;
+  }
+  uregex_close(re);
+  finish(r, lat, c->nrecords);
+  free(lat);
+  return !U_FAILURE(uec);
+}
+
+/* only " and \ need escaping in the names and patterns we write */
+static void
+json_string(FILE * fp, const char * s)
+{
+  putc('"', fp);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') putc('\\', fp);
+    if ((unsigned char)*s < ' ') fprintf(fp, "\\u%04x", *s);
+    else putc(*s, fp);
+  }
+  putc('"', fp);
+}
+
+static void
+json_result(FILE * fp, const char * key, const struct result_s * r, double mb, size_t n)
+{
+  fprintf(fp, "\"%s\": {\"ns_per_record\": %.1f, \"mb_per_s\": %.2f, "
+          "\"p50_ns\": %lu, \"p99_ns\": %lu, \"matches\": %lu}",
+          key, n ? (double)r->ns / (double)n : 0.0,
+          r->ns ? mb / ((double)r->ns / 1e9) : 0.0,
+          (unsigned long)r->p50, (unsigned long)r->p99, (unsigned long)r->matches);
+}
+
+static UChar *
+to_utf16(const char * s, size_t * len)
+{
+  UErrorCode uec = U_ZERO_ERROR;
+  int32_t n = 0;
+  UChar * u;
+  if (!s) s = "";
+  u_strFromUTF8(NULL, 0, &n, s, -1, &uec);
+  uec = U_ZERO_ERROR;
+  if (!(u = malloc(((size_t)n + 1) * sizeof(UChar)))) return NULL;
+  u_strFromUTF8(u, n + 1, NULL, s, -1, &uec);
+  *len = (size_t)n;
+  return u;
+}
+
+/* slope of the least-squares line through (log x, log y) */
+static double
+fit_exponent(const double * x, const double * y, size_t n)
+{
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, d;
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    double lx = log(x[i]), ly = log(y[i]);
+    sx += lx; sy += ly; sxx += lx * lx; sxy += lx * ly;
+  }
+  d = (double)n * sxx - sx * sx;
+  return (n < 2 || d == 0) ? 0.0 : ((double)n * sxy - sx * sy) / d;
+}
+
+#define SCALE_STEPS (64)
+
+static bool
+run_scale(const struct bench_s * b, rgx_prog * prog, FILE * json, bool * first)
+{
+  UChar ** subs = malloc(rgx_group_count(prog) * 2 * sizeof(UChar *));
+  size_t sl, ml, el, n, i, steps = 0;
+  UChar * str = to_utf16(b->str, &sl);
+  UChar * mid = to_utf16(b->mid, &ml);
+  UChar * end = to_utf16(b->end, &el);
+  double len[SCALE_STEPS], ns[SCALE_STEPS], bytes[SCALE_STEPS], allocs[SCALE_STEPS];
+  bool matched[SCALE_STEPS];
+  bool stopped = false;
+  double kt, km;
+  if (!subs || !str || !mid || !end) return false;
+
+  for (n = b->from; n <= b->to && steps < SCALE_STEPS; n *= 2) {
+    size_t ul = (sl + el) * n + ml;
+    UChar * u = malloc((ul + 1) * sizeof(UChar));
+    uint64_t t, total = 0, reps = 0;
+    size_t a0;
+    long long m0;
+    if (!u) return false;
+    for (i = 0; i < n; ++i) memcpy(u + i * sl, str, sl * sizeof(UChar));
+    memcpy(u + n * sl, mid, ml * sizeof(UChar));
+    for (i = 0; i < n; ++i) memcpy(u + n * sl + ml + i * el, end, el * sizeof(UChar));
+
+    /* the first run alone gives the allocation counts */
+    a0 = __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+    m0 = mem_mark();
+    do {
+      uint64_t t0 = now_ns();
+      matched[steps] = rgx_exec(prog, u, ul, subs, rgx_group_count(prog) * 2);
+      t = now_ns() - t0;
+      if (!reps++) {
+        allocs[steps] = (double)(__atomic_load_n(&nallocs, __ATOMIC_RELAXED) - a0);
+        bytes[steps] = (double)(__atomic_load_n(&peak, __ATOMIC_RELAXED) - m0);
+      }
+      total += t;
+    } while (total < SCALE_SAMPLE && t < SCALE_LIMIT);
+    free(u);
+
+    len[steps] = (double)ul;
+    ns[steps] = (double)total / (double)reps;
+    printf("%-16s %10lu %12.0f %12.1f %12.0f %10.0f %s\n", b->name, (unsigned long)ul,
+           ns[steps], ns[steps] / (double)ul, bytes[steps], allocs[steps],
+           matched[steps] ? "match" : "");
+    fflush(stdout);
+    if (bytes[steps] < 1) bytes[steps] = 1;
+    steps++;
+    if (t >= SCALE_LIMIT) { stopped = n * 2 <= b->to; break; }
+  }
+
+  kt = fit_exponent(len, ns, steps);
+  km = fit_exponent(len, bytes, steps);
+  if (steps < 2) {
+    /* too slow at the smallest size to say anything but that */
+    kt = km = 0;
+    stopped = true;
+    printf("%-16s too slow to fit  SUPERLINEAR?\n\n", b->name);
+  } else {
+    printf("%-16s time ~ n^%.2f, memory ~ n^%.2f%s%s\n\n", b->name, kt, km,
+           (kt > SCALE_LINEAR || km > SCALE_LINEAR) ? "  SUPERLINEAR" : "",
+           stopped ? " (stopped early)" : "");
+  }
+
+  if (json) {
+    fprintf(json, "%s  {\"name\": ", *first ? "" : ",\n");
+    json_string(json, b->name);
+    fprintf(json, ", \"pattern\": ");
+    json_string(json, b->rgx);
+    fprintf(json, ",\n   \"time_exponent\": %.3f, \"memory_exponent\": %.3f, "
+            "\"superlinear\": %s, \"stopped_early\": %s,\n   \"sizes\": [",
+            kt, km, (steps < 2 || kt > SCALE_LINEAR || km > SCALE_LINEAR) ? "true" : "false",
+            stopped ? "true" : "false");
+    for (i = 0; i < steps; ++i) {
+      fprintf(json, "%s\n     {\"length\": %.0f, \"ns\": %.0f, \"peak_bytes\": %.0f, "
+              "\"allocs\": %.0f, \"match\": %s}", i ? "," : "", len[i], ns[i],
+              bytes[i], allocs[i], matched[i] ? "true" : "false");
+    }
+    fprintf(json, "]}");
+    *first = false;
+  }
+  free(str); free(mid); free(end);
+  free(subs);
+  return true;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+static bool
+read_bench(struct bench_s * b, char * tok)
+{
+  bml_token tk;
+  do {
+    tk = bml_next(stdin, tok, TOKMAX);
+    if (tk == BML_EOF) return false;
+  } while (tk != BML_OPEN || (strcmp(tok, "bench") && strcmp(tok, "scale")));
+
+  free(b->name); free(b->rgx); free(b->icu); free(b->file); free(b->str);
+  free(b->mid); free(b->end);
+  memset(b, 0, sizeof(*b));
+  b->scale = !strcmp(tok, "scale");
+  b->repeat = 1;
+  b->from = 1024;
+  b->to = 65536;
+  while ((tk = bml_next(stdin, tok, TOKMAX)) == BML_ATTR) {
+    char ** dst = NULL;
+    size_t * num = NULL;
+    if      (!strcmp(tok, "name"))   dst = &b->name;
+    else if (!strcmp(tok, "rgx"))    dst = &b->rgx;
+    else if (!strcmp(tok, "icu"))    dst = &b->icu;
+    else if (!strcmp(tok, "file"))   dst = &b->file;
+    else if (!strcmp(tok, "str"))    dst = &b->str;
+    else if (!strcmp(tok, "mid"))    dst = &b->mid;
+    else if (!strcmp(tok, "end"))    dst = &b->end;
+    else if (!strcmp(tok, "repeat")) num = &b->repeat;
+    else if (!strcmp(tok, "from"))   num = &b->from;
+    else if (!strcmp(tok, "to"))     num = &b->to;
+    else return false;
+    if (bml_next(stdin, tok, TOKMAX) != BML_VALUE) return false;
+    if (dst) { free(*dst); *dst = strdup(tok); }
+    else *num = (size_t)strtoul(tok, NULL, 10);
+  }
+  if (!b->name) b->name = strdup("?");
+  if (!b->from) b->from = 1;
+  return b->rgx != NULL;
+}
+
+int
+main(int argc, char ** argv)
+{
+  static struct bench_s bench;
+  static char tok[TOKMAX];
+  FILE * json = NULL;
+  bool first = true, header = false;
+  int status = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "o:")) != -1) {
+    if (c != 'o') { fprintf(stderr, "usage: rebench [-o results.json] < benches.txt\n"); return 2; }
+    if (!(json = fopen(optarg, "w"))) { perror(optarg); return 2; }
+  }
+  if (json) fprintf(json, "[\n");
+
+  while (read_bench(&bench, tok)) {
+    struct corpus_s corpus;
+    struct result_s rr, ri;
+    struct rusage ru;
+    rgx_prog * prog;
+    int32_t * spans;
+    UChar * upat;
+    size_t plen, allocs = 0, mismatches = 0;
+    bool icuok;
+    double mb;
+
+    if (!(upat = to_utf16(bench.rgx, &plen))) { perror("rebench"); return 2; }
+    if (rgx_compile(&prog, upat, plen) != RGX_OK) {
+      fprintf(stderr, "%s: can't compile '%s'\n", bench.name, bench.rgx); status = 1;
+      free(upat); continue;
+    }
+    if (bench.scale) {
+      printf("%-16s %10s %12s %12s %12s %10s\n", "scale", "length",
+             "ns/match", "ns/unit", "peak bytes", "allocs");
+      header = false;
+      if (!run_scale(&bench, prog, json, &first)) { perror("rebench"); return 2; }
+      rgx_free(prog);
+      free(upat);
+      continue;
+    }
+    if (!load_corpus(&bench, &corpus)) {
+      fprintf(stderr, "%s: can't load corpus\n", bench.name); status = 1;
+      rgx_free(prog);
+      free(upat); continue;
+    }
+    if (!header) {
+      printf("%-16s %8s %10s %9s %9s %9s %8s | %10s %9s %9s %s\n", "bench", "records",
+             "ns/rec", "MB/s", "p50", "p99", "allocs", "icu ns/rec", "icu MB/s", "icu p99",
+             "mismatch");
+      header = true;
+    }
+    spans = malloc((corpus.nrecords + 1) * 2 * sizeof(int32_t));
+    if (!spans || !run_rgx(prog, &corpus, spans, &rr, &allocs)) { perror("rebench"); return 2; }
+    icuok = run_icu(bench.icu ? bench.icu : bench.rgx, &corpus, spans, &ri, &mismatches);
+    if (!icuok) memset(&ri, 0, sizeof(ri));
+    if (mismatches) status = 1;
+    getrusage(RUSAGE_SELF, &ru);
+
+    mb = (double)corpus.bytes / (1024.0 * 1024.0);
+    printf("%-16s %8lu %10.1f %9.2f %9lu %9lu %8.2f | %10.1f %9.2f %9lu %s\n", bench.name,
+           (unsigned long)corpus.nrecords,
+           corpus.nrecords ? (double)rr.ns / (double)corpus.nrecords : 0.0,
+           rr.ns ? mb / ((double)rr.ns / 1e9) : 0.0,
+           (unsigned long)rr.p50, (unsigned long)rr.p99,
+           corpus.nrecords ? (double)allocs / (double)corpus.nrecords : 0.0,
+           corpus.nrecords ? (double)ri.ns / (double)corpus.nrecords : 0.0,
+           ri.ns ? mb / ((double)ri.ns / 1e9) : 0.0, (unsigned long)ri.p99,
+           icuok ? (mismatches ? "MISMATCH" : "ok") : "icu-error");
+    fflush(stdout);
+
+    if (json) {
+      fprintf(json, "%s  {\"name\": ", first ? "" : ",\n");
+      json_string(json, bench.name);
+      fprintf(json, ", \"pattern\": ");
+      json_string(json, bench.rgx);
+      fprintf(json, ", \"records\": %lu, \"bytes\": %lu,\n   ",
+              (unsigned long)corpus.nrecords, (unsigned long)corpus.bytes);
+      json_result(json, "rgx", &rr, mb, corpus.nrecords);
+      fprintf(json, ",\n   \"allocs_per_record\": %.2f, \"peak_rss_kb\": %ld,\n   ",
+              corpus.nrecords ? (double)allocs / (double)corpus.nrecords : 0.0, ru.ru_maxrss);
+      if (icuok) json_result(json, "icu", &ri, mb, corpus.nrecords);
+      else fprintf(json, "\"icu\": null");
+      fprintf(json, ",\n   \"mismatches\": %lu}", (unsigned long)mismatches);
+      first = false;
+    }
+    free(spans);
+    free(upat);
+    rgx_free(prog);
+    free_corpus(&corpus);
+  }
+
+  if (json) { fprintf(json, "\n]\n"); fclose(json); }
+  return status;
+}
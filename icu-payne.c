@@ -2,6 +2,9 @@
  */
 #include "icu-payne.h"
 #include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* ********************************************************************** */
 /* ********************************************************************** */
@@ -222,19 +225,22 @@ u_strdup(const UChar * s)
  * each other (besides some bidi stuff).
  *
  * Unfortunately, providing a (uni_map_get_match(map, val)) function
- * is harder than it sounds, since the mapping can be one-to-many.
+ * is harder than it sounds, since the mapping can be one-to-many,
+ * so each brace gets a short list of partners (see makebraces.c).
+ * Every brace is in the BMP.
  */
 
-typedef struct uni_map_s {
-  struct uni_map_entry_s {
-    UChar32 from;
-    UChar32 to;
-  } * buf;
-  size_t len;
-} uni_map;
-
 #include "braces.c.inc"
 
+/* The brace number of c (an index into uni_brace_partner), 0 if none */
+static inline unsigned int
+uni_brace(UChar32 c)
+{
+  if ((uint32_t)c > 0xFFFF) return 0;
+  return uni_brace_data[uni_brace_index[c / uni_brace_block] * uni_brace_block
+                        + (unsigned)c % uni_brace_block];
+}
+
 static USet *
 uni_set_open(UChar32 * s, size_t n)
 {
@@ -258,79 +264,91 @@ uni_set_open_right(void)
   return uni_set_open(uni_set_right, uni_set_right_length);
 }
 
-static bool
-uni_set_contains(const UChar32 * m, size_t mlen, UChar32 val)
-{
-  size_t lo = 0;
-  size_t hi = mlen - 1;
-  while (lo <= hi) {
-    size_t mid = lo + ((hi - lo) / 2);
-    if      (m[mid] > val) hi = mid - 1;
-    else if (m[mid] < val) lo = mid + 1;
-    else return true;
-  }
-  return false;
-}
-
-static bool
-uni_map_contains(const uni_map * m, UChar32 val)
-{
-  size_t lo = 0;
-  size_t hi = m->len - 1;
-  while (lo <= hi) {
-    size_t mid = lo + ((hi - lo) / 2);
-    if      (m->buf[mid] > val) hi = mid - 1;
-    else if (m->buf[mid] < val) lo = mid + 1;
-    else return true;
-  }
-  return false;
-}
-
-static bool
-uni_map_ismapped(const uni_map * m, UChar32 from, UChar32 to)
-{
-  size_t lo = 0;
-  size_t hi = m->len - 1;
-  while (lo <= hi) {
-    size_t mid = lo + ((hi - lo) / 2);
-    if      (from < m->buf[mid].from) hi = mid - 1;
-    else if (from > m->buf[mid].from) lo = mid + 1;
-    else if (to   < m->buf[mid].to  ) hi = mid - 1;
-    else if (to   > m->buf[mid].to  ) lo = mid + 1;
-    else return true;
-  }
-  return false;
-}
-
 bool
 uni_isopen(UChar32 c)
 {
-  return uni_set_contains(uni_set_left, uni_set_left_length, c);
+  return (uni_class(c) & UNI_CLASS_OPEN) != 0;
 }
 
 bool
 uni_isclose(UChar32 c)
 {
-  return uni_set_contains(uni_set_right, uni_set_right_length, c);
+  return (uni_class(c) & UNI_CLASS_CLOSE) != 0;
 }
 
 bool
 uni_ismatch(UChar32 a, UChar32 b)
 {
-  return uni_map_ismapped(&uni_map_braces, a, b);
+  const UChar * p = uni_brace_partner[uni_brace(a)];
+  size_t i;
+  if ((uint32_t)b > 0xFFFF || !b) return false;
+  for (i = 0; i < sizeof(uni_brace_partner[0]) / sizeof(UChar); ++i) {
+    if (p[i] == b) return true;
+  }
+  return false;
 }
 
+#ifdef __SSE2__
+/* Eight units that are equal and can't be braces: below the first
+ * non-ASCII brace, and none of the ASCII ones.
+ */
+static bool
+uni_quote_plain8(const UChar * a, const UChar * b)
+{
+  __m128i va = _mm_loadu_si128((const __m128i *)a);
+  __m128i vb = _mm_loadu_si128((const __m128i *)b);
+  __m128i high = _mm_subs_epu16(va, _mm_set1_epi16((short)(uni_brace_nonascii_min - 1)));
+  __m128i ok = _mm_and_si128(_mm_cmpeq_epi16(va, vb), _mm_cmpeq_epi16(high, _mm_setzero_si128()));
+  size_t k;
+  for (k = 0; k < uni_brace_ascii_length; ++k)
+    ok = _mm_andnot_si128(_mm_cmpeq_epi16(va, _mm_set1_epi16((short)uni_brace_ascii[k])), ok);
+  return _mm_movemask_epi8(ok) == 0xFFFF;
+}
+#endif
+
 bool
 uni_quote_equal(const UChar * a, const UChar * b, size_t n)
 {
-  size_t i;
-  for (i = 0; i < n; ++i) {
-    if (a[i] == b[i] ? uni_map_contains(&uni_map_braces, a[i]) /* "("   "("  */
-                     : !uni_ismatch(a[i], b[i]))               /* "(" [^")"] */
-      return false;
+  size_t i = 0;
+  while (i < n) {
+    size_t end = n - i > 8 ? i + 8 : n;
+#ifdef __SSE2__
+    if (end == i + 8 && uni_quote_plain8(a + i, b + i)) { i = end; continue; }
+#endif
+    for (; i < end; ++i) {
+      if (a[i] == b[i] ? uni_brace(a[i]) != 0   /* "("   "("  */
+                       : !uni_ismatch(a[i], b[i])) /* "(" [^")"] */
+        return false;
+    }
   }
   return true;
 }
 
 /* ********************************************************************** */
 /* ********************************************************************** */
+
+#include "classes.c.inc"
+
+unsigned int
+uni_class(UChar32 c)
+{
+  if (!uni_is_valid(c)) return 0;
+  return uni_class_data[uni_class_index[c / uni_class_block] * uni_class_block
+                        + (unsigned)c % uni_class_block];
+}
+
+/* For set operations; the matcher uses uni_class().
+ */
+USet *
+uni_class_set_open(unsigned int cls)
+{
+  USet * set = uset_openEmpty();
+  UChar32 c, lo = -1;
+  if (!set) return NULL;
+  for (c = UCHAR_MIN_VALUE; c <= UCHAR_MAX_VALUE + 1; ++c) {
+    bool in = c <= UCHAR_MAX_VALUE && (uni_class(c) & cls);
+    if (in && lo < 0) lo = c;
+    if (!in && lo >= 0) { uset_addRange(set, lo, c - 1); lo = -1; }
+  }
+  return set;
+}
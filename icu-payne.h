@@ -65,4 +65,20 @@ extern bool uni_quote_equal(const UChar * a, const UChar * b, size_t n);
 /* ********************************************************************** */
 /* ********************************************************************** */
 
+/* Builtin classes, looked up in tables generated by makeclasses.c.
+ */
+#define UNI_CLASS_DIGIT   0x01  /* \d */
+#define UNI_CLASS_WORD    0x02  /* \w */
+#define UNI_CLASS_SPACE   0x04  /* \s */
+#define UNI_CLASS_VSPACE  0x08  /* \v */
+#define UNI_CLASS_HSPACE  0x10  /* \h */
+#define UNI_CLASS_OPEN    0x20  /* \o */
+#define UNI_CLASS_CLOSE   0x40  /* \c */
+
+extern unsigned int uni_class(UChar32 c);
+extern USet * uni_class_set_open(unsigned int cls);
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
 #endif /* UNI_PAYNE_H_ */
@@ -1,4 +1,11 @@
 /* Parse UnicodeData.txt and BidiBrackets.txt into C data
+ *
+ * The pairs are written as a two-stage table over the BMP:
+ * uni_brace_index[c >> 8] picks a 256-entry block of uni_brace_data,
+ * which holds each code unit's brace number (0 if it isn't one), and
+ * uni_brace_partner[number] lists what it pairs with. The braces below
+ * U+0080, and the first above, are written out too, so a run of text can
+ * be checked for braces a vector at a time.
  */
 #include <stdio.h>
 #include <string.h>
@@ -6,6 +13,9 @@
 #include <ctype.h>
 
 #define MAXPAIRS 2048
+#define BLOCK     256
+#define NBLOCKS   (0x10000 / BLOCK)
+#define MAXMATES  3 /* most partners of one brace (U+2019, U+201D) */
 
 /* BidiBrackets:
  * (?comment: #[^\n]*\n )
@@ -174,18 +184,77 @@ map_unique(struct map_s * m)
   m->len = unique(m->buf, m->len, sizeof(struct pair_s), map_sort_cmp);
 }
 
+/* ********************************************************************** */
+/* Brace Table */
+/* ********************************************************************** */
+
+static unsigned char brace_data[0x10000];
+static int brace_mates[256][MAXMATES];
+static unsigned int brace_index[NBLOCKS];
+static unsigned int brace_unique[NBLOCKS]; /* first block of each distinct block */
+static unsigned int brace_uniquelen;
+
+/* m must be sorted, so each brace lists its partners in order */
 static void
-map_write(struct map_s * m, const char * name)
+brace_write(struct map_s * m)
 {
-  size_t i;
-  printf("static struct uni_map_entry_s uni_map_%s_data[%u] = {\n", name, (unsigned)m->len);
-  for (i = 0; i < m->len; ++i) {
-    printf("  { 0x%04X, 0x%04X }%s\n",
-           m->buf[i].from, m->buf[i].to,
-           i + 1 >= m->len ? "" : ",");
+  unsigned int nbraces = 0;
+  unsigned int b, u, i, j;
+  int ascii[128];
+  unsigned int nascii = 0;
+  int nonascii = 0xFFFF;
+  size_t k;
+
+  for (k = 0; k < m->len; ++k) {
+    int from = m->buf[k].from;
+    if (from > 0xFFFF || m->buf[k].to > 0xFFFF) {
+      fprintf(stderr, "brace %04X outside the BMP\n", from); exit(2);
+    }
+    if (!brace_data[from]) {
+      if (++nbraces > 255) { fprintf(stderr, "too many braces\n"); exit(2); }
+      brace_data[from] = (unsigned char)nbraces;
+      if (from < 0x80) ascii[nascii++] = from;
+      else if (from < nonascii) nonascii = from;
+    }
+    for (j = 0; j < MAXMATES && brace_mates[brace_data[from]][j]; ++j) continue;
+    if (j >= MAXMATES) { fprintf(stderr, "MAXMATES too small\n"); exit(2); }
+    brace_mates[brace_data[from]][j] = m->buf[k].to;
+  }
+
+  for (b = 0; b < NBLOCKS; ++b) {
+    for (u = 0; u < brace_uniquelen; ++u) {
+      if (!memcmp(brace_data + b * BLOCK, brace_data + brace_unique[u] * BLOCK, BLOCK)) break;
+    }
+    if (u == brace_uniquelen) brace_unique[brace_uniquelen++] = b;
+    brace_index[b] = u;
+  }
+
+  printf("static const uint8_t uni_brace_index[%u] = {", (unsigned)NBLOCKS);
+  for (i = 0; i < NBLOCKS; ++i) {
+    printf("%s%u%s", (i % 16) ? " " : "\n  ", brace_index[i], i + 1 >= NBLOCKS ? "" : ",");
+  }
+  printf("\n};\n");
+  printf("static const uint8_t uni_brace_data[%u] = {", brace_uniquelen * BLOCK);
+  for (u = 0; u < brace_uniquelen; ++u) {
+    for (i = 0; i < BLOCK; ++i) {
+      printf("%s%u%s", (i % 16) ? " " : "\n  ", brace_data[brace_unique[u] * BLOCK + i],
+             (u + 1 >= brace_uniquelen && i + 1 >= BLOCK) ? "" : ",");
+    }
+  }
+  printf("\n};\n");
+  printf("#define uni_brace_block (%u)\n", (unsigned)BLOCK);
+  printf("static const UChar uni_brace_partner[%u][%u] = {\n", nbraces + 1, (unsigned)MAXMATES);
+  for (i = 0; i <= nbraces; ++i) {
+    printf("  {");
+    for (j = 0; j < MAXMATES; ++j) printf(" 0x%04X%s", brace_mates[i][j], j + 1 >= MAXMATES ? "" : ",");
+    printf(" }%s\n", i >= nbraces ? "" : ",");
   }
   printf("};\n");
-  printf("uni_map uni_map_%s = { uni_map_%s_data, %u };\n", name, name, (unsigned)m->len);
+  printf("static const UChar uni_brace_ascii[%u] = {", nascii);
+  for (i = 0; i < nascii; ++i) printf(" 0x%04X%s", ascii[i], i + 1 >= nascii ? "" : ",");
+  printf(" };\n");
+  printf("#define uni_brace_ascii_length (%u)\n", nascii);
+  printf("#define uni_brace_nonascii_min (0x%04X)\n", nonascii);
 }
 
 /* ********************************************************************** */
@@ -407,6 +476,6 @@ main(void)
   map_sort(&map_braces); map_unique(&map_braces);
   set_write(&set_left, "left");
   set_write(&set_right, "right");
-  map_write(&map_braces, "braces");
+  brace_write(&map_braces);
   return 0;
 }
@@ -0,0 +1,108 @@
+/* Evaluate the builtin classes (\d \w \s \v \h \o \c) with ICU and write
+ * them out as C data, so the matcher doesn't need ICU to test them.
+ *
+ * Two-stage table: uni_class_index[c >> 8] picks a 256-entry block of
+ * uni_class_data, which holds the UNI_CLASS_* bits of each code point.
+ * Complements are the same lookup with the bit inverted.
+ */
+#include "icu-payne.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define BLOCK     256
+#define NBLOCKS   ((UCHAR_MAX_VALUE + 1) / BLOCK)
+
+#include "braces.c.inc"
+
+static struct class_s {
+  unsigned int bit;
+  const char * pattern;
+} classes[] = {
+  { UNI_CLASS_DIGIT,  "\\p{nd}" },
+  { UNI_CLASS_WORD,   "[\\p{alpha}\\p{m}\\p{n}\\p{pc}\\p{joinc}]" },
+  { UNI_CLASS_SPACE,  "\\p{whitespace}" },
+  { UNI_CLASS_VSPACE, "[\\n\\v\\f\\r\\x85\\u2028\\u2029]" },
+  { UNI_CLASS_HSPACE, "[\\t\\p{zs}]" },
+  { 0, NULL }
+};
+
+static unsigned char data[UCHAR_MAX_VALUE + 1];
+static unsigned int index_[NBLOCKS];
+static unsigned int unique[NBLOCKS]; /* first block of each distinct block */
+static unsigned int uniquelen;
+
+static void
+add_pattern(const char * pat, unsigned int bit)
+{
+  UErrorCode uec = U_ZERO_ERROR;
+  UChar buf[128];
+  USet * set;
+  int32_t i, n;
+
+  u_charsToUChars(pat, buf, (int32_t)strlen(pat) + 1);
+  set = uset_openPattern(buf, -1, &uec);
+  if (U_FAILURE(uec)) {
+    fprintf(stderr, "bad pattern %s: %s\n", pat, u_errorName(uec)); exit(2);
+  }
+  n = uset_getItemCount(set);
+  for (i = 0; i < n; ++i) {
+    UChar32 lo, hi;
+    uec = U_ZERO_ERROR;
+    if (uset_getItem(set, i, &lo, &hi, NULL, 0, &uec) != 0) continue; /* strings */
+    for (; lo <= hi; ++lo) data[lo] |= (unsigned char)bit;
+  }
+  uset_close(set);
+}
+
+static void
+add_list(const UChar32 * s, size_t n, unsigned int bit)
+{
+  size_t i;
+  for (i = 0; i < n; ++i) data[s[i]] |= (unsigned char)bit;
+}
+
+static void
+build_blocks(void)
+{
+  unsigned int b, u;
+  for (b = 0; b < NBLOCKS; ++b) {
+    for (u = 0; u < uniquelen; ++u) {
+      if (!memcmp(data + b * BLOCK, data + unique[u] * BLOCK, BLOCK)) break;
+    }
+    if (u == uniquelen) unique[uniquelen++] = b;
+    index_[b] = u;
+  }
+}
+
+static void
+write_tables(void)
+{
+  unsigned int i, u;
+  printf("static const uint16_t uni_class_index[%u] = {", (unsigned)NBLOCKS);
+  for (i = 0; i < NBLOCKS; ++i) {
+    printf("%s%u%s", (i % 16) ? " " : "\n  ", index_[i], i + 1 >= NBLOCKS ? "" : ",");
+  }
+  printf("\n};\n");
+  printf("static const uint8_t uni_class_data[%u] = {", uniquelen * BLOCK);
+  for (u = 0; u < uniquelen; ++u) {
+    for (i = 0; i < BLOCK; ++i) {
+      printf("%s0x%02X%s", (i % 16) ? " " : "\n  ", data[unique[u] * BLOCK + i],
+             (u + 1 >= uniquelen && i + 1 >= BLOCK) ? "" : ",");
+    }
+  }
+  printf("\n};\n");
+  printf("#define uni_class_block (%u)\n", (unsigned)BLOCK);
+}
+
+int
+main(void)
+{
+  struct class_s * c;
+  for (c = classes; c->pattern; ++c) add_pattern(c->pattern, c->bit);
+  add_list(uni_set_left, uni_set_left_length, UNI_CLASS_OPEN);
+  add_list(uni_set_right, uni_set_right_length, UNI_CLASS_CLOSE);
+  build_blocks();
+  write_tables();
+  return 0;
+}
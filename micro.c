@@ -0,0 +1,394 @@
+/* remicro: what the primitives cost, one at a time.
+ *
+ *   remicro [-n units] [-p passes] [-s seed]
+ *
+ * regex.c is included whole, so its static helpers (sub_update, the
+ * builtin class sets) can be called directly. Each primitive runs over
+ * generated corpora with a known mix of characters:
+ *
+ *   ascii   letters, digits, spaces and non-brace punctuation
+ *   bmp     a third each ASCII, Greek/Cyrillic and CJK
+ *   astral  all outside the BMP (surrogate pairs): emoji, math letters
+ *           and digits, CJK extension B
+ *   mixed   half ASCII, half astral
+ *   braces  half brackets and quotes, half ASCII letters
+ *
+ * Each result is the best of several passes, in nanoseconds per call and
+ * (on x86) time-stamp-counter ticks per call.
+ */
+#define RGX_NO_MAIN 1
+#include "regex.c"
+
+#include <time.h>
+#include <unistd.h>
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+static volatile uintmax_t sink; /* keeps the results from being optimized away */
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* xorshift64*; the corpora only need to be the same from run to run */
+static uint64_t rng_state;
+
+static uint32_t
+rng(uint32_t n)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)(((rng_state * 2685821657736338717ull) >> 32) % n);
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+struct range_s { UChar32 lo, hi; };
+
+static const char ascii_chars[] =
+  "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,;:!?-_=+*/";
+
+static const struct range_s bmp_ranges[] = {
+  { 0x0391, 0x03C9 }, /* Greek */
+  { 0x0410, 0x044F }, /* Cyrillic */
+  { 0x4E00, 0x9FFF }, /* CJK */
+};
+
+static const struct range_s astral_ranges[] = {
+  { 0x1F300, 0x1F64F }, /* emoji */
+  { 0x1D400, 0x1D7FF }, /* math letters and digits */
+  { 0x20000, 0x2A6DF }, /* CJK extension B */
+};
+
+/* open, close */
+static const UChar32 brace_pairs[][2] = {
+  { '(', ')' }, { '[', ']' }, { '{', '}' },
+  { 0x2045, 0x2046 }, { 0xFF08, 0xFF09 }, { 0x300C, 0x300D },
+  { 0x300E, 0x300F }, { 0x3010, 0x3011 }, { 0x27E8, 0x27E9 },
+};
+#define brace_pairs_length  (sizeof(brace_pairs) / sizeof(brace_pairs[0]))
+
+enum corpus_kind { C_ASCII, C_BMP, C_ASTRAL, C_MIXED, C_BRACES, C_COUNT };
+static const char * corpus_names[C_COUNT] = { "ascii", "bmp", "astral", "mixed", "braces" };
+
+struct corpus_s {
+  const char * name;
+  UChar * text;
+  UChar * mirror; /* text with every brace swapped for its partner */
+  size_t len;
+  UChar32 * cps;  /* text decoded */
+  size_t ncps;
+};
+
+static UChar32
+pick_range(const struct range_s * r, size_t n)
+{
+  const struct range_s * p = &r[rng((uint32_t)n)];
+  return p->lo + (UChar32)rng((uint32_t)(p->hi - p->lo + 1));
+}
+
+static UChar32
+pick_ascii(void)
+{
+  return (UChar32)ascii_chars[rng(sizeof(ascii_chars) - 1)];
+}
+
+/* the character, and its mirror image */
+static void
+pick(enum corpus_kind kind, UChar32 * c, UChar32 * m)
+{
+  *m = 0;
+  switch (kind) {
+    case C_ASCII:  *c = pick_ascii(); break;
+    case C_BMP:    *c = rng(3) ? pick_range(bmp_ranges, 3) : pick_ascii(); break;
+    case C_ASTRAL: *c = pick_range(astral_ranges, 3); break;
+    case C_MIXED:  *c = rng(2) ? pick_range(astral_ranges, 3) : pick_ascii(); break;
+    case C_BRACES:
+      if (rng(2)) {
+        const UChar32 * p = brace_pairs[rng(brace_pairs_length)];
+        bool open = rng(2);
+        *c = p[!open];
+        *m = p[open];
+      } else {
+        *c = (UChar32)ascii_chars[rng(52)];
+      }
+      break;
+    default: *c = ' '; break;
+  }
+  if (!*m) *m = *c;
+}
+
+static bool
+make_corpus(struct corpus_s * cp, enum corpus_kind kind, size_t n)
+{
+  size_t i = 0;
+  memset(cp, 0, sizeof(*cp));
+  cp->name = corpus_names[kind];
+  cp->text = malloc(n * sizeof(UChar));
+  cp->mirror = malloc(n * sizeof(UChar));
+  cp->cps = malloc(n * sizeof(UChar32));
+  if (!cp->text || !cp->mirror || !cp->cps) return false;
+  while (i + 1 < n) {
+    UChar32 c, m;
+    pick(kind, &c, &m);
+    cp->cps[cp->ncps++] = c;
+    U16_APPEND_UNSAFE(cp->text, i, c);
+    i -= (size_t)U16_LENGTH(c);
+    U16_APPEND_UNSAFE(cp->mirror, i, m);
+  }
+  cp->len = i;
+  return true;
+}
+
+static void
+free_corpus(struct corpus_s * cp)
+{
+  free(cp->text);
+  free(cp->mirror);
+  free(cp->cps);
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+/* one pass over the corpus; returns the number of calls made */
+typedef size_t (*micro_fn)(const struct corpus_s * cp, unsigned int arg);
+
+static size_t
+m_iter_next(const struct corpus_s * cp, unsigned int arg)
+{
+  uni_iter it;
+  UChar32 c;
+  uintmax_t s = 0;
+  size_t n = 0;
+  (void)arg;
+  uni_iter_init(&it, cp->text, cp->len);
+  while ((c = uni_iter_next(&it)) != EOF) { s += (uintmax_t)c; n++; }
+  sink += s;
+  return n;
+}
+
+static size_t
+m_iter_prev(const struct corpus_s * cp, unsigned int arg)
+{
+  uni_iter it;
+  UChar32 c;
+  uintmax_t s = 0;
+  size_t n = 0;
+  (void)arg;
+  uni_iter_init(&it, cp->text, cp->len);
+  it.curp = it.endp;
+  while ((c = uni_iter_prev(&it)) != EOF) { s += (uintmax_t)c; n++; }
+  sink += s;
+  return n;
+}
+
+/* at every code unit, so a trail surrogate is peeked at too */
+static size_t
+m_iter_peek(const struct corpus_s * cp, unsigned int arg)
+{
+  uni_iter it;
+  uintmax_t s = 0;
+  size_t i;
+  (void)arg;
+  uni_iter_init(&it, cp->text, cp->len);
+  for (i = 0; i < cp->len; ++i) {
+    it.curp = cp->text + i;
+    s += (uintmax_t)uni_iter_peek(&it);
+  }
+  sink += s;
+  return cp->len;
+}
+
+static size_t
+m_uset_contains(const struct corpus_s * cp, unsigned int cls)
+{
+  const USet * set = charset_builtin(cls, false);
+  uintmax_t s = 0;
+  size_t i;
+  for (i = 0; i < cp->ncps; ++i) s += uset_contains(set, cp->cps[i]) ? 1u : 0u;
+  sink += s;
+  return cp->ncps;
+}
+
+static size_t
+m_uni_class(const struct corpus_s * cp, unsigned int cls)
+{
+  uintmax_t s = 0;
+  size_t i;
+  for (i = 0; i < cp->ncps; ++i) s += (uni_class(cp->cps[i]) & cls) ? 1u : 0u;
+  sink += s;
+  return cp->ncps;
+}
+
+static size_t
+m_isopen(const struct corpus_s * cp, unsigned int arg)
+{
+  uintmax_t s = 0;
+  size_t i;
+  (void)arg;
+  for (i = 0; i < cp->ncps; ++i) s += (uni_isopen(cp->cps[i]) ? 1u : 0u) + (uni_isclose(cp->cps[i]) ? 1u : 0u);
+  sink += s;
+  return cp->ncps * 2;
+}
+
+static size_t
+m_ismatch(const struct corpus_s * cp, unsigned int arg)
+{
+  uintmax_t s = 0;
+  size_t i;
+  (void)arg;
+  for (i = 0; i < cp->len; ++i) s += uni_ismatch(cp->text[i], cp->mirror[i]) ? 1u : 0u;
+  sink += s;
+  return cp->len;
+}
+
+/* in slices of ARG units, as a back-reference would compare them */
+static size_t
+m_quote_equal(const struct corpus_s * cp, unsigned int arg)
+{
+  uintmax_t s = 0;
+  size_t i, n = 0;
+  for (i = 0; i + arg <= cp->len; i += arg, ++n) {
+    s += uni_quote_equal(cp->text + i, cp->mirror + i, arg) ? 1u : 0u;
+  }
+  sink += s;
+  return n;
+}
+
+/* ARG submatch slots; every other update finds the submatch shared and copies it */
+static size_t
+m_sub_update(const struct corpus_s * cp, unsigned int arg)
+{
+  struct matcher_s mm;
+  rgx_submatch * s;
+  uintmax_t k = 0;
+  size_t i, n = cp->len;
+  memset(&mm, 0, sizeof(mm));
+  mm.alloc = &libc_allocator;
+  mm.nsubs = arg;
+  uni_iter_init(&mm.iter, cp->text, cp->len);
+  s = sub_new(&mm);
+  for (i = 0; i < arg; ++i) s->ptrs[i] = NULL;
+  for (i = 0; i < n; ++i) {
+    rgx_submatch * t;
+    mm.iter.curp = cp->text + i;
+    if (i & 1) {
+      t = sub_update(&mm, s, i % arg);         /* alone: updated in place */
+    } else {
+      t = sub_update(&mm, sub_inc(&mm, s), i % arg); /* shared: copied */
+      sub_dec(&mm, s);
+    }
+    k += (uintmax_t)(t->ptrs[i % arg] - cp->text);
+    s = t;
+  }
+  sub_dec(&mm, s);
+  matcher_close(&mm);
+  sink += k;
+  return n;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+struct micro_s {
+  const char * name;
+  micro_fn fn;
+  unsigned int arg;
+  unsigned int corpora; /* 1 << corpus_kind */
+};
+
+#define ALL_TEXT  ((1u << C_ASCII) | (1u << C_BMP) | (1u << C_ASTRAL) | (1u << C_MIXED))
+#define ALL       (ALL_TEXT | (1u << C_BRACES))
+
+static const struct micro_s micros[] = {
+  { "uni_iter_next",         m_iter_next,     0,              ALL_TEXT },
+  { "uni_iter_prev",         m_iter_prev,     0,              ALL_TEXT },
+  { "uni_iter_peek",         m_iter_peek,     0,              ALL_TEXT },
+  { "uset_contains digit",   m_uset_contains, CLS_DIGIT,      ALL_TEXT },
+  { "uset_contains word",    m_uset_contains, CLS_WORD,       ALL_TEXT },
+  { "uset_contains space",   m_uset_contains, CLS_SPACE,      ALL_TEXT },
+  { "uset_contains vspace",  m_uset_contains, CLS_VSPACE,     ALL_TEXT },
+  { "uset_contains hspace",  m_uset_contains, CLS_HSPACE,     ALL_TEXT },
+  { "uset_contains open",    m_uset_contains, CLS_OPEN,       ALL },
+  { "uset_contains close",   m_uset_contains, CLS_CLOSE,      ALL },
+  { "uni_class word",        m_uni_class,     CLS_WORD,       ALL_TEXT },
+  { "uni_isopen/isclose",    m_isopen,        0,              ALL },
+  { "uni_ismatch",           m_ismatch,       0,              1u << C_BRACES },
+  { "uni_quote_equal 16",    m_quote_equal,   16,             (1u << C_ASCII) | (1u << C_BRACES) },
+  { "uni_quote_equal 256",   m_quote_equal,   256,            (1u << C_ASCII) | (1u << C_BRACES) },
+  { "sub_update 2",          m_sub_update,    2,              1u << C_ASCII },
+  { "sub_update 8",          m_sub_update,    8,              1u << C_ASCII },
+  { "sub_update 32",         m_sub_update,    32,             1u << C_ASCII },
+};
+#define micros_length  (sizeof(micros) / sizeof(micros[0]))
+
+int
+main(int argc, char ** argv)
+{
+  static struct corpus_s corpora[C_COUNT];
+  size_t units = 1 << 20;
+  unsigned int passes = 5;
+  uint64_t seed = 0x5EED;
+  size_t i, k;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:p:s:")) != -1) {
+    switch (c) {
+      case 'n': units = (size_t)strtoul(optarg, NULL, 0); break;
+      case 'p': passes = (unsigned int)strtoul(optarg, NULL, 0); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "usage: remicro [-n units] [-p passes] [-s seed]\n");
+        return 2;
+    }
+  }
+  if (units < 2) units = 2;
+  if (!passes) passes = 1;
+
+  rng_state = seed ? seed : 1;
+  for (k = 0; k < C_COUNT; ++k) {
+    if (!make_corpus(&corpora[k], (enum corpus_kind)k, units)) { perror("remicro"); return 2; }
+  }
+  pthread_once(&ucat_once, init_charsets);
+
+  printf("%-22s %-8s %10s %10s %10s\n", "primitive", "corpus", "calls", "ns/call", "ticks/call");
+  for (i = 0; i < micros_length; ++i) {
+    for (k = 0; k < C_COUNT; ++k) {
+      uint64_t best = UINT64_MAX, bestticks = 0;
+      size_t calls = 0;
+      unsigned int p;
+      if (!(micros[i].corpora & (1u << k))) continue;
+      for (p = 0; p < passes; ++p) {
+        uint64_t t0 = now_ns(), k0 = ticks();
+        calls = micros[i].fn(&corpora[k], micros[i].arg);
+        k0 = ticks() - k0;
+        t0 = now_ns() - t0;
+        if (t0 < best) { best = t0; bestticks = k0; }
+      }
+      printf("%-22s %-8s %10lu %10.2f %10.2f\n", micros[i].name, corpora[k].name,
+             (unsigned long)calls, calls ? (double)best / (double)calls : 0.0,
+             calls ? (double)bestticks / (double)calls : 0.0);
+    }
+  }
+
+  for (k = 0; k < C_COUNT; ++k) free_corpus(&corpora[k]);
+  return 0;
+}
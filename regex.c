@@ -19,52 +19,167 @@
 /* ********************************************************************** */
 /* ********************************************************************** */
 
-#include "icu-payne.h"
+#include "regex.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Static tracing probes, for perf/bpftrace/systemtap to attach to in a
+ * running process; built with -DRGX_PROBES (needs <sys/sdt.h>). Each is a
+ * single nop until something attaches. Provider "regex":
+ *
+ *   compile_start  (pattern, length)
+ *   compile_done   (length, opcodes, error)
+ *   exec_start     (input, length)
+ *   exec_done      (length, matched, code units scanned)
+ *   nested_start   (pc, depth, kind)  kind is "looks" or "procs"
+ *   nested_done    (pc, depth, matched)
+ *   marks_reset    (program length)   the per-pc marks were cleared
+ */
+#ifdef RGX_PROBES
+#include <sys/sdt.h>
+#define PROBE1(N,A)            DTRACE_PROBE1(regex, N, A)
+#define PROBE2(N,A,B)          DTRACE_PROBE2(regex, N, A, B)
+#define PROBE3(N,A,B,C)        DTRACE_PROBE3(regex, N, A, B, C)
+#else
+#define PROBE1(N,A)            do{ }while(0)
+#define PROBE2(N,A,B)          do{ }while(0)
+#define PROBE3(N,A,B,C)        do{ }while(0)
+#endif
 
 #define Q(EX)  do{ rgx_error e_ = (EX); if (e_) return e_; }while(0)
 #define QN(EX) do{ if ((EX) == NULL) return RGX_MEMORY; }while(0)
 
+#define FF(I) do{ fprintf(stdout, "%d\n", (I)); fflush(stdout); }while(0)
+
 /* ********************************************************************** */
 /* ********************************************************************** */
 
-typedef enum rgx_error_e {
-  RGX_OK = 0,
-  RGX_MEMORY,          /*  1  malloc failed */
-  RGX_TOO_LONG,        /*  2  regex would compile into too many opcodes */
-  RGX_OVERFLOW,        /*  3  {n,m} integer overflow */
-  RGX_BAD_REPEAT,      /*  4  {n,m} n > m */
-  RGX_BAD_SET,         /*  5  malformed [] */
-  RGX_BAD_DIRECTIVE,   /*  6  malformed {} */
-  RGX_MISSING_BRACE,   /*  7  missing } after { */
-  RGX_BAD_GROUP,       /*  8  unexpected after (? */
-  RGX_MISSING_PAREN,   /*  9  missing ) after ( */
-  RGX_BAD_ESCAPE,      /* 10  malformed \escape sequence */
-  RGX_MISSING_BRACKET, /* 11  missing ] after [ */
-  RGX_BAD_NAME,        /* 12  name too long or missing terminator */
-  RGX_UNDEFINED,       /* 13  name is referenced but not defined */
-  RGX_REDEFINED,       /* 14  procedure has multiple definitions */
-  RGX_EXTRA_JUNK       /* 15  expr<rep><rep> */
-} rgx_error;
+/* Memory. A program keeps the allocator it was compiled with, and uses it
+ * for everything it owns and everything a search on it needs, its
+ * telemetry record included. ICU makes the character sets with its own
+ * allocator (u_setMemoryFunctions, if the application set one), and the
+ * property-set cache they live in is process-wide, so neither goes
+ * through the hook.
+ */
+static void *
+libc_alloc(void * userdata, size_t size)
+{
+  (void)userdata;
+  return malloc(size);
+}
 
-#define FF(I) do{ fprintf(stdout, "%d\n", (I)); fflush(stdout); }while(0)
+static void *
+libc_resize(void * userdata, void * ptr, size_t size)
+{
+  (void)userdata;
+  return realloc(ptr, size);
+}
+
+static void
+libc_release(void * userdata, void * ptr)
+{
+  (void)userdata;
+  free(ptr);
+}
+
+static const rgx_allocator libc_allocator = { libc_alloc, libc_resize, libc_release, NULL };
+
+#define MEM_ALLOC(A,N)     ((A)->alloc((A)->userdata, (N)))
+#define MEM_RESIZE(A,P,N)  ((A)->resize((A)->userdata, (P), (N)))
+#define MEM_FREE(A,P)      ((A)->release((A)->userdata, (P)))
+
+/* What compiling needs only until it's done comes from an arena, which
+ * goes back in one go however the compile ends.
+ */
+#define RGX_ARENA_BLOCK  (16 * 1024)
+#define ARENA_ALIGN      (2 * sizeof(void*))
+#define ARENA_ROUND(N)   (((N) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_block_s {
+  struct arena_block_s * next;
+  size_t used;
+  size_t cap;
+};
+
+struct arena_s {
+  const rgx_allocator * alloc;
+  struct arena_block_s * blocks; /* the one being carved up first */
+};
+
+static void *
+arena_alloc(struct arena_s * ar, size_t n)
+{
+  struct arena_block_s * b = ar->blocks;
+  n = ARENA_ROUND(n ? n : 1);
+  if (!b || b->cap - b->used < n) {
+    size_t cap = n > RGX_ARENA_BLOCK / 4 ? n : RGX_ARENA_BLOCK;
+    if (!(b = MEM_ALLOC(ar->alloc, ARENA_ROUND(sizeof(*b)) + cap))) return NULL;
+    b->used = 0;
+    b->cap = cap;
+    if (cap == n && ar->blocks) { /* a big one of its own; keep carving the last */
+      b->next = ar->blocks->next;
+      ar->blocks->next = b;
+    } else {
+      b->next = ar->blocks;
+      ar->blocks = b;
+    }
+  }
+  b->used += n;
+  return (char *)b + ARENA_ROUND(sizeof(*b)) + b->used - n;
+}
+
+/* make room for one more at *len, doubling *cap when full */
+static bool
+arena_grow(struct arena_s * ar, void * pp, size_t size, size_t len, size_t * cap)
+{
+  void ** p = pp;
+  void * q;
+  if (len < *cap) return true;
+  if (!(q = arena_alloc(ar, (*cap ? *cap * 2 : 8) * size))) return false;
+  if (len) memcpy(q, *p, len * size);
+  *p = q;
+  *cap = *cap ? *cap * 2 : 8;
+  return true;
+}
+
+static UChar *
+arena_strdup(struct arena_s * ar, const UChar * s)
+{
+  size_t n = ((size_t)u_strlen(s) + 1) * sizeof(UChar);
+  UChar * d = arena_alloc(ar, n);
+  if (d) memcpy(d, s, n);
+  return d;
+}
+
+static void
+arena_release(struct arena_s * ar)
+{
+  while (ar->blocks) {
+    struct arena_block_s * b = ar->blocks;
+    ar->blocks = b->next;
+    MEM_FREE(ar->alloc, b);
+  }
+}
 
 /* ********************************************************************** */
 /* ********************************************************************** */
 
 static char fmtbuf0[128];
-static char fmtbuf1[128];
-static char fmtbuf2[128];
 static char *
 ustr0(const UChar * s)
 {
   UErrorCode uec = U_ZERO_ERROR;
   return u_strToUTF8(fmtbuf0, sizeof(fmtbuf0), NULL, s, -1, &uec);
 }
+#ifndef RGX_NO_MAIN /* only the tests need more than one */
+static char fmtbuf1[128];
+static char fmtbuf2[128];
 static char *
 ustr1(const UChar * s)
 {
@@ -77,6 +192,7 @@ ustr2(const UChar * s)
   UErrorCode uec = U_ZERO_ERROR;
   return u_strToUTF8(fmtbuf2, sizeof(fmtbuf2), NULL, s, -1, &uec);
 }
+#endif
 
 /* ********************************************************************** */
 /* ********************************************************************** */
@@ -95,10 +211,13 @@ ustr2(const UChar * s)
 #define RGX_REP_MAX   (65535)      /* big enough, but prevents integer overflow */
 #define RGX_LEN_MAX   (64*1024)    /* larger than most text files (*ahem* Notepad) */
 #define RGX_CODE_MAX  (1024*1024)  /* 1M * sizeof(rgx_code)B == much MB */
+#define RGX_TRIE_MIN  (8)          /* literal alternations this big become a trie */
+#define RGX_PEEK_MAX  (16)         /* look-arounds this short are checked in place */
 
 typedef enum rgx_tree_type_e {
   TREE_CHAR,    /* a */
   TREE_SET,     /* [] */
+  TREE_CLASS,   /* \d \w ... {digit} {word} ... */
   TREE_ANY,     /* . {any} */
   TREE_NONE,    /*   {^any} */
   TREE_BOL,     /* ^ {line-start} */
@@ -129,10 +248,14 @@ typedef enum rgx_tree_type_e {
   TREE_PROC,    /* \gname; {call name} */
   TREE_NPROC,   /* \Gname; {^call name} */
   TREE_COND,    /* (??ctf) */
+  TREE_TRIE,    /* one|two|three|... (made by simplify) */
+  TREE_BALANCED, /* {balanced} */
 } rgx_tree_type;
 
 #define index_t  int  /* avoid size_t, keep opcodes small */
 
+typedef struct rgx_trie_s rgx_trie;
+
 typedef struct rgx_tree_s rgx_tree;
 struct rgx_tree_s {
   rgx_tree_type type;
@@ -142,11 +265,19 @@ struct rgx_tree_s {
     index_t xindex;     /* TREE_GROUP, TREE_BREF, TREE_NBREF, TREE_PROC, TREE_NPROC, TREE_COND */
     UChar32 cvalue;     /* TREE_CHAR */
     USet * xset;        /* TREE_SET */
+    struct {            /* TREE_CLASS; also OP_CLASS */
+      unsigned int xmask;
+      bool neg;
+    } cls;
     struct {            /* TREE_REPEAT, TREE_QUEST, TREE_PLUS, TREE_STAR */
       int min;
       int max;
       bool greedy;
     } rep;
+    struct {            /* TREE_TRIE */
+      rgx_trie * fwd;
+      rgx_trie * rev;   /* null if only emitted forward */
+    } trie;
   } u;
 };
 #define right      u.xright
@@ -157,10 +288,72 @@ struct rgx_tree_s {
 #define repgreedy  u.rep.greedy
 #define chval      u.cvalue
 #define chset      u.xset
+#define clsmask    u.cls.xmask
+#define clsneg     u.cls.neg
+#define triefwd    u.trie.fwd
+#define trierev    u.trie.rev
 
 /* ********************************************************************** */
 /* ********************************************************************** */
 
+/* FNV-1a over the code units */
+static size_t
+name_hash(const UChar * s)
+{
+  size_t h = (size_t)2166136261u;
+  while (*s) { h ^= *s++; h *= 16777619u; }
+  return h;
+}
+
+/* Names to indexes while parsing; open addressing, at most half full */
+struct symtab_s {
+  struct symbol_s {
+    const UChar * name; /* null if empty */
+    index_t idx;
+  } * slots;
+  size_t cap; /* a power of two */
+  size_t len;
+};
+
+/* the slot holding name, or the empty one it would go in */
+static struct symbol_s *
+symtab_slot(const struct symtab_s * st, const UChar * name)
+{
+  size_t i = name_hash(name) & (st->cap - 1);
+  while (st->slots[i].name && u_strcmp(st->slots[i].name, name)) i = (i + 1) & (st->cap - 1);
+  return &st->slots[i];
+}
+
+static index_t
+symtab_find(const struct symtab_s * st, const UChar * name)
+{
+  struct symbol_s * sym;
+  if (!st->cap) return -1;
+  sym = symtab_slot(st, name);
+  return sym->name ? sym->idx : -1;
+}
+
+static bool
+symtab_add(struct arena_s * ar, struct symtab_s * st, const UChar * name, index_t idx)
+{
+  struct symbol_s * sym;
+  if (2 * (st->len + 1) > st->cap) {
+    struct symtab_s old = *st;
+    size_t i;
+    st->cap = old.cap ? old.cap * 2 : 16;
+    if (!(st->slots = arena_alloc(ar, st->cap * sizeof(struct symbol_s)))) return false;
+    memset(st->slots, 0, st->cap * sizeof(struct symbol_s));
+    for (i = 0; i < old.cap; ++i) {
+      if (old.slots[i].name) *symtab_slot(st, old.slots[i].name) = old.slots[i];
+    }
+  }
+  sym = symtab_slot(st, name);
+  sym->name = name;
+  sym->idx = idx;
+  st->len++;
+  return true;
+}
+
 struct tokenizer_s {
   /* the input pattern */
   uni_iter iter;
@@ -170,6 +363,7 @@ struct tokenizer_s {
   rgx_tree * nodes;
   size_t nodesidx;
   size_t nodeslen;
+  rgx_tree * freenodes; /* released by simplify(), chained through left */
 
   /* sub-match and back-reference names */
   struct backref_s {
@@ -177,6 +371,8 @@ struct tokenizer_s {
     bool defined; /* true if (?foo:) seen, false if only \kfoo; */
   } * refs;
   size_t refslen;
+  size_t refscap;
+  struct symtab_s refsyms;
 
   /* named procedures */
   struct procref_s {
@@ -186,21 +382,49 @@ struct tokenizer_s {
     void * locrev; /* rgx_code; compiled location */
   } * procs;
   size_t procslen;
+  size_t procscap;
+  struct symtab_s procsyms;
+
+  /* memory: scratch from the arena, and what may end up in the program */
+  const rgx_allocator * alloc;
+  struct arena_s arena;
+  USet ** sets; /* every set made, used or not */
+  size_t setslen;
+  size_t setscap;
+  rgx_trie ** tries;
+  size_t trieslen;
+  size_t triescap;
+  rgx_prog * prog; /* until compile hands it over */
 };
 
+/* Keep track of a new set; closed at the end of compile if the program
+ * doesn't use it. Null if set is, or if it couldn't be tracked.
+ */
+static USet *
+tk_set(struct tokenizer_s * tk, USet * set)
+{
+  if (set && !arena_grow(&tk->arena, &tk->sets, sizeof(USet*), tk->setslen, &tk->setscap)) {
+    uset_close(set);
+    return NULL;
+  }
+  if (set) tk->sets[tk->setslen++] = set;
+  return set;
+}
+
 static rgx_error
 lookup_group(struct tokenizer_s * tk, UChar * name, bool isdef, index_t * idx)
 {
-  size_t i;
-  for (i = 0; i < tk->refslen; ++i) {
-    if (!u_strCompare(tk->refs[i].name, -1, name, -1, true)) {
-      tk->refs[i].defined |= isdef;
-      if (idx) *idx = (index_t)i;
-      return RGX_OK;
-    }
+  index_t i = symtab_find(&tk->refsyms, name);
+  if (i >= 0) {
+    tk->refs[i].defined |= isdef;
+    if (idx) *idx = i;
+    return RGX_OK;
   }
-  QN(tk->refs = realloc(tk->refs, (tk->refslen + 1) * sizeof(struct backref_s)));
-  QN(tk->refs[tk->refslen].name = u_strdup(name));
+  if (!arena_grow(&tk->arena, &tk->refs, sizeof(struct backref_s), tk->refslen, &tk->refscap))
+    return RGX_MEMORY;
+  QN(tk->refs[tk->refslen].name = arena_strdup(&tk->arena, name));
+  if (!symtab_add(&tk->arena, &tk->refsyms, tk->refs[tk->refslen].name, (index_t)tk->refslen))
+    return RGX_MEMORY;
   tk->refs[tk->refslen].defined = isdef;
   if (idx) *idx = (index_t)tk->refslen;
   tk->refslen++;
@@ -210,19 +434,20 @@ lookup_group(struct tokenizer_s * tk, UChar * name, bool isdef, index_t * idx)
 static rgx_error
 lookup_proc(struct tokenizer_s * tk, UChar * name, rgx_tree * body, index_t * idx)
 {
-  size_t i;
-  for (i = 0; i < tk->procslen; ++i) {
-    if (!u_strCompare(tk->procs[i].name, -1, name, -1, true)) {
-      if (body) {
-        if (tk->procs[i].body != NULL) return RGX_REDEFINED;
-        tk->procs[i].body = body;
-      }
-      if (idx) *idx = (index_t)i;
-      return RGX_OK;
+  index_t i = symtab_find(&tk->procsyms, name);
+  if (i >= 0) {
+    if (body) {
+      if (tk->procs[i].body != NULL) return RGX_REDEFINED;
+      tk->procs[i].body = body;
     }
+    if (idx) *idx = i;
+    return RGX_OK;
   }
-  QN(tk->procs = realloc(tk->procs, (tk->procslen + 1) * sizeof(struct procref_s)));
-  QN(tk->procs[tk->procslen].name = u_strdup(name));
+  if (!arena_grow(&tk->arena, &tk->procs, sizeof(struct procref_s), tk->procslen, &tk->procscap))
+    return RGX_MEMORY;
+  QN(tk->procs[tk->procslen].name = arena_strdup(&tk->arena, name));
+  if (!symtab_add(&tk->arena, &tk->procsyms, tk->procs[tk->procslen].name, (index_t)tk->procslen))
+    return RGX_MEMORY;
   tk->procs[tk->procslen].body = body;
   if (idx) *idx = (index_t)tk->procslen;
   tk->procslen++;
@@ -235,43 +460,218 @@ static rgx_tree *
 tree_new2(struct tokenizer_s * tk, rgx_tree_type type,
           rgx_tree * rl, rgx_tree * rr)
 {
-  rgx_tree * re = tk->nodes + tk->nodesidx++;
-  assert(tk->nodesidx <= tk->nodeslen);
+  rgx_tree * re = tk->freenodes;
+  if (re != NULL) {
+    tk->freenodes = re->left;
+  } else {
+    re = tk->nodes + tk->nodesidx++;
+    assert(tk->nodesidx <= tk->nodeslen);
+  }
   re->type = type;
   re->left = rl;
   re->right = rr;
   return re;
 }
 
-static bool ucat_init = false;
-static USet * ucat_digit;
-static USet * ucat_word;
-static USet * ucat_space;
-static USet * ucat_vspace;
-static USet * ucat_hspace;
-static USet * ucat_open;
-static USet * ucat_close;
+/* Builtin classes as bits, so the matcher can classify a character once
+ * per step for every assertion and class that asks (see char_class).
+ * Membership comes from the tables generated by makeclasses.c; a USet is
+ * only made when a class takes part in set operations.
+ */
+#define CLS_DIGIT   UNI_CLASS_DIGIT
+#define CLS_WORD    UNI_CLASS_WORD
+#define CLS_SPACE   UNI_CLASS_SPACE
+#define CLS_VSPACE  UNI_CLASS_VSPACE
+#define CLS_HSPACE  UNI_CLASS_HSPACE
+#define CLS_OPEN    UNI_CLASS_OPEN
+#define CLS_CLOSE   UNI_CLASS_CLOSE
+#define CLS_KNOWN   0x100 /* the mask has been computed */
+#define CLS_EOF     0x200
+
+static struct ucat_entry_s {
+  unsigned int cls;
+  const char * name;
+  USet * set; /* made on first use by init_charsets, then frozen */
+  USet * neg;
+} ucat_table[] = {
+  { CLS_DIGIT,  "digit",       NULL, NULL },
+  { CLS_WORD,   "word",        NULL, NULL },
+  { CLS_SPACE,  "space",       NULL, NULL },
+  { CLS_VSPACE, "vspace",      NULL, NULL },
+  { CLS_HSPACE, "hspace",      NULL, NULL },
+  { CLS_OPEN,   "open-brace",  NULL, NULL },
+  { CLS_CLOSE,  "close-brace", NULL, NULL },
+};
+#define ucat_table_length  (sizeof(ucat_table) / sizeof(ucat_table[0]))
 
-static rgx_error
+static pthread_once_t ucat_once = PTHREAD_ONCE_INIT;
+
+/* Every class and complement, made together the first time any is needed.
+ * A failed allocation leaves a null for charset_builtin to report.
+ */
+static void
 init_charsets(void)
+{
+  size_t i;
+  for (i = 0; i < ucat_table_length; ++i) {
+    struct ucat_entry_s * e = &ucat_table[i];
+    if (!(e->set = uni_class_set_open(e->cls))) continue;
+    if ((e->neg = uset_clone(e->set)) != NULL) {
+      uset_complement(e->neg);
+      uset_freeze(e->neg);
+    }
+    uset_freeze(e->set);
+  }
+}
+
+/* The USet of a builtin class (or its complement), shared by every
+ * pattern that uses it in a bracket.
+ */
+static USet *
+charset_builtin(unsigned int cls, bool neg)
+{
+  size_t i;
+  pthread_once(&ucat_once, init_charsets);
+  for (i = 0; i < ucat_table_length; ++i) {
+    if (ucat_table[i].cls == cls) return neg ? ucat_table[i].neg : ucat_table[i].set;
+  }
+  return NULL;
+}
+
+/* Property sets (\p{...} and {gc=...}) by expression, shared like the
+ * builtin classes: made once, frozen, with the complement made alongside,
+ * and never closed. The expression is trimmed the way ICU trims it, so
+ * spacing around '=' doesn't make a new entry. Past PROPSET_MAX entries,
+ * new expressions get sets of their own again.
+ */
+#define PROPSET_BUCKETS  256
+#define PROPSET_MAX      4096
+#define PROPSET_KEYLEN   128
+
+static struct propset_s {
+  struct propset_s * next;
+  USet * set;
+  USet * neg;
+  UChar expr[]; /* normalized */
+} * propset_table[PROPSET_BUCKETS];
+static size_t propset_count;
+static pthread_mutex_t propset_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct propset_s *
+propset_find(const UChar * expr, size_t hash)
+{
+  struct propset_s * e = propset_table[hash % PROPSET_BUCKETS];
+  while (e && u_strcmp(e->expr, expr)) e = e->next;
+  return e;
+}
+
+/* The body of the braces without white space at either end, or around
+ * '=' and ':'. False if it doesn't fit.
+ */
+static bool
+propset_key(UChar * key, const UChar * body, size_t len)
+{
+  size_t i, n = 0;
+  for (i = 0; i < len; ++i) {
+    if (u_isWhitespace(body[i])) {
+      size_t j = i;
+      while (j < len && u_isWhitespace(body[j])) j++;
+      if (n == 0 || j == len || key[n - 1] == '=' || key[n - 1] == ':' ||
+          body[j] == '=' || body[j] == ':') { i = j - 1; continue; }
+    }
+    if (n + 1 >= PROPSET_KEYLEN) return false;
+    key[n++] = body[i];
+  }
+  key[n] = '\0';
+  return true;
+}
+
+/* The set for \p{body}, or \P{body} if neg. */
+static rgx_error
+charset_property(struct tokenizer_s * tk, const UChar * body, size_t len, bool neg,
+                 rgx_error bad, USet ** out)
 {
   UErrorCode uec = U_ZERO_ERROR;
-  UChar buf[64];
-#define MAKE_PAT(DST,PAT) do{ \
-  u_charsToUChars((PAT), buf, sizeof(PAT)); \
-  QN((DST) = uset_openPattern(buf, -1, &uec)); \
-  if (U_FAILURE(uec)) return RGX_MEMORY; \
-}while(0)
-  MAKE_PAT(ucat_digit,  "\\p{nd}");
-  MAKE_PAT(ucat_word,   "[\\p{alpha}\\p{m}\\p{n}\\p{pc}\\p{joinc}]");
-  MAKE_PAT(ucat_space,  "\\p{whitespace}");
-  MAKE_PAT(ucat_vspace, "[\\n\\v\\f\\r\\x85\\u2028\\u2029]");
-  MAKE_PAT(ucat_hspace, "[\\t\\p{zs}]");
-  QN(ucat_open = uni_set_open_left());
-  QN(ucat_close = uni_set_open_right());
-  ucat_init = true;
+  UChar pat[PROPSET_KEYLEN + 4] = { '\\', 'p', '{' };
+  UChar * key = pat + 3;
+  struct propset_s * e;
+  USet * set, * nset;
+  size_t hash, n;
+
+  if (!propset_key(key, body, len)) { /* too long to keep; ICU decides */
+    UChar * p;
+    QN(p = arena_alloc(&tk->arena, (len + 4) * sizeof(UChar)));
+    memcpy(p, pat, 3 * sizeof(UChar));
+    memcpy(p + 3, body, len * sizeof(UChar));
+    p[len + 3] = '}';
+    if (neg) p[1] = 'P';
+    set = tk_set(tk, uset_openPattern(p, (int32_t)(len + 4), &uec));
+    if (U_FAILURE(uec)) return bad;
+    QN(*out = set);
+    return RGX_OK;
+  }
+  hash = name_hash(key);
+  pthread_mutex_lock(&propset_lock);
+  e = propset_find(key, hash);
+  pthread_mutex_unlock(&propset_lock);
+  if (e) { *out = neg ? e->neg : e->set; return RGX_OK; }
+
+  n = (size_t)u_strlen(key);
+  key[n] = '}';
+  set = uset_openPattern(pat, (int32_t)(n + 4), &uec);
+  key[n] = '\0';
+  if (U_FAILURE(uec)) { if (set) uset_close(set); return bad; }
+  QN(set);
+  if (!(nset = uset_clone(set))) { uset_close(set); return RGX_MEMORY; }
+  uset_complement(nset);
+  uset_freeze(set);
+  uset_freeze(nset);
+
+  pthread_mutex_lock(&propset_lock);
+  if ((e = propset_find(key, hash)) == NULL && propset_count < PROPSET_MAX &&
+      (e = malloc(sizeof(struct propset_s) + (n + 1) * sizeof(UChar))) != NULL) {
+    u_strcpy(e->expr, key);
+    e->set = set;
+    e->neg = nset;
+    e->next = propset_table[hash % PROPSET_BUCKETS];
+    propset_table[hash % PROPSET_BUCKETS] = e;
+    propset_count++;
+    set = nset = NULL;
+  }
+  pthread_mutex_unlock(&propset_lock);
+  if (e) { /* in the cache, whether ours or another thread's */
+    if (set) { uset_close(set); uset_close(nset); }
+    *out = neg ? e->neg : e->set;
+    return RGX_OK;
+  }
+  /* not kept: the pattern owns them like any other set */
+  QN(set = tk_set(tk, set));
+  QN(nset = tk_set(tk, nset));
+  *out = neg ? nset : set;
+  return RGX_OK;
+}
+
+/* TREE_CLASS -> TREE_SET, for set operations */
+static rgx_error
+charset_of_class(rgx_tree * re)
+{
+  if (re->type == TREE_CLASS) {
+    USet * set;
+    QN(set = charset_builtin(re->clsmask, re->clsneg));
+    re->type = TREE_SET;
+    re->chset = set;
+  }
   return RGX_OK;
-#undef MAKE_PAT
+}
+
+static const char *
+charset_class_name(unsigned int cls)
+{
+  size_t i;
+  for (i = 0; i < ucat_table_length; ++i) {
+    if (ucat_table[i].cls == cls) return ucat_table[i].name;
+  }
+  return "?";
 }
 
 /* ********************************************************************** */
@@ -289,9 +689,9 @@ static rgx_error parse_single(struct tokenizer_s * tk, rgx_tree ** re);
 static bool
 skip_spaces(struct tokenizer_s * tk)
 {
-  while (MORE && (CUR == '#' || uset_contains(ucat_space, CUR))) {
+  while (MORE && (CUR == '#' || (uni_class(CUR) & CLS_SPACE))) {
     if (CUR == '#') {
-      do { NEXT; } while (MORE && !uset_contains(ucat_vspace, CUR));
+      do { NEXT; } while (MORE && !(uni_class(CUR) & CLS_VSPACE));
     }
     NEXT;
   }
@@ -317,7 +717,7 @@ gather_word(struct tokenizer_s * tk, UChar * buf, size_t buflen, rgx_error err)
 {
   size_t i = 0;
   if (!skip_spaces(tk)) return err;
-  while (!uset_contains(ucat_space, CUR) && CUR != '}') {
+  while (!(uni_class(CUR) & CLS_SPACE) && CUR != '}') {
     buf[i++] = (UChar)CUR;
     if (i >= buflen) return err;
     if (CUR == '$' || CUR == ':' || CUR == '=') { NEXT; break; }
@@ -343,13 +743,15 @@ escape_hex(struct tokenizer_s * tk, rgx_tree * re)
 static rgx_error
 escape_property(struct tokenizer_s * tk, rgx_tree * re)
 {
-  UErrorCode uec = U_ZERO_ERROR;
-  const UChar * start = tk->iter.curp - 2; /* include the backslash */
+  bool neg = CUR == 'P';
+  const UChar * start;
+  NEXT; if (CUR != '{') return RGX_BAD_ESCAPE;
+  start = tk->iter.curp;
   while (CUR != '}') { NEXT; if (!MORE) return RGX_BAD_ESCAPE; }
   re->type = TREE_SET;
-  re->chset = uset_openPattern(start, (int32_t)(tk->iter.curp - start), &uec);
+  Q(charset_property(tk, start, (size_t)(tk->iter.curp - 1 - start), neg, RGX_BAD_ESCAPE, &re->chset));
   NEXT; /* '}' */
-  return (U_FAILURE(uec)) ? RGX_BAD_ESCAPE : RGX_OK;
+  return RGX_OK;
 }
 
 static rgx_error
@@ -379,7 +781,9 @@ static rgx_error
 parse_escape(struct tokenizer_s * tk, rgx_tree * re)
 {
 #define ESC_CHAR(C) do{ re->type = TREE_CHAR; re->chval = (C); NEXT; }while(0)
-#define ESC_SET(CAT) do{ re->type = TREE_SET; re->chset = (CAT); NEXT; }while(0)
+#define ESC_CLS(CLS) do{ \
+  re->type = TREE_CLASS; re->clsmask = (CLS); re->clsneg = isneg; NEXT; \
+}while(0)
   bool isneg = false;
   if (!MORE) return RGX_BAD_ESCAPE;
   switch (CUR) {
@@ -388,13 +792,13 @@ parse_escape(struct tokenizer_s * tk, rgx_tree * re)
     case 'M': case 'm': return escape_backref(tk, re);
     case 'G': case 'g': return escape_procref(tk, re);
     case 'P': case 'p': return escape_property(tk, re);
-    case 'D': isneg = true; case 'd': ESC_SET(ucat_digit); break;
-    case 'W': isneg = true; case 'w': ESC_SET(ucat_word); break;
-    case 'S': isneg = true; case 's': ESC_SET(ucat_space); break;
-    case 'V': isneg = true; case 'v': ESC_SET(ucat_vspace); break;
-    case 'H': isneg = true; case 'h': ESC_SET(ucat_hspace); break;
-    case 'O': isneg = true; case 'o': ESC_SET(ucat_open); break;
-    case 'C': isneg = true; case 'c': ESC_SET(ucat_close); break;
+    case 'D': isneg = true; case 'd': ESC_CLS(CLS_DIGIT); break;
+    case 'W': isneg = true; case 'w': ESC_CLS(CLS_WORD); break;
+    case 'S': isneg = true; case 's': ESC_CLS(CLS_SPACE); break;
+    case 'V': isneg = true; case 'v': ESC_CLS(CLS_VSPACE); break;
+    case 'H': isneg = true; case 'h': ESC_CLS(CLS_HSPACE); break;
+    case 'O': isneg = true; case 'o': ESC_CLS(CLS_OPEN); break;
+    case 'C': isneg = true; case 'c': ESC_CLS(CLS_CLOSE); break;
     case 'r': ESC_CHAR('\r'); break;
     case 'n': ESC_CHAR('\n'); break;
     case 't': ESC_CHAR('\t'); break;
@@ -406,27 +810,26 @@ parse_escape(struct tokenizer_s * tk, rgx_tree * re)
     case 'B': re->type = TREE_NWBND; NEXT; break;
     default:  ESC_CHAR(CUR); break;
   }
-  if (isneg) {
-    QN(re->chset = uset_clone(re->chset));
-    uset_complement(re->chset);
-  }
   return RGX_OK;
 #undef ESC_CHAR
-#undef ESC_SET
+#undef ESC_CLS
 }
 
 #define DIRECTIVE(V,S,E) UNI_STRING_DECL(V,S);
 #include "directives.inc"
 
 static void
-init_directives(void)
+init_directives_once(void)
 {
-  static bool dir_init = false;
-  if (!dir_init) {
 #define DIRECTIVE(V,S,E) UNI_STRING_INIT(V,S);
 #include "directives.inc"
-    dir_init = true;
-  }
+}
+
+static void
+init_directives(void)
+{
+  static pthread_once_t dir_once = PTHREAD_ONCE_INIT;
+  pthread_once(&dir_once, init_directives_once);
 }
 
 static UChar * directives[] = {
@@ -459,13 +862,10 @@ find_directive(const UChar * buf)
 static rgx_error
 parse_directive(struct tokenizer_s * tk, rgx_tree * re)
 {
-#define ESC_SET(CAT) do{ \
-  re->type = TREE_SET; \
-  re->chset = (CAT); \
-  if (isneg) { \
-    QN(re->chset = uset_clone(re->chset)); \
-    uset_complement(re->chset); \
-  } \
+#define ESC_CLS(CLS) do{ \
+  re->type = TREE_CLASS; \
+  re->clsmask = (CLS); \
+  re->clsneg = isneg; \
 }while(0)
 #define ESC_TYPE(T) do{ \
   re->type = (T); \
@@ -495,13 +895,13 @@ parse_directive(struct tokenizer_s * tk, rgx_tree * re)
     case D_INPUT_END:   ESC_TYPE(isneg ? TREE_NEOT : TREE_EOT); break;
     case D_WORD_BREAK:  ESC_TYPE(isneg ? TREE_NWBND : TREE_WBND); break;
     case D_ANY:         ESC_TYPE(isneg ? TREE_NONE : TREE_ANY); break;
-    case D_DIGIT:       ESC_SET(ucat_digit);  break;
-    case D_WORD:        ESC_SET(ucat_word);   break;
-    case D_SPACE:       ESC_SET(ucat_space);  break;
-    case D_VSPACE:      ESC_SET(ucat_vspace); break;
-    case D_HSPACE:      ESC_SET(ucat_hspace); break;
-    case D_OPEN_BRACE:  ESC_SET(ucat_open);   break;
-    case D_CLOSE_BRACE: ESC_SET(ucat_close);  break;
+    case D_DIGIT:       ESC_CLS(CLS_DIGIT);   break;
+    case D_WORD:        ESC_CLS(CLS_WORD);    break;
+    case D_SPACE:       ESC_CLS(CLS_SPACE);   break;
+    case D_VSPACE:      ESC_CLS(CLS_VSPACE);  break;
+    case D_HSPACE:      ESC_CLS(CLS_HSPACE);  break;
+    case D_OPEN_BRACE:  ESC_CLS(CLS_OPEN);    break;
+    case D_CLOSE_BRACE: ESC_CLS(CLS_CLOSE);   break;
     case D_EQUAL:
     case D_REF: {
       ESC_TYPE(isneg ? TREE_NBREF : TREE_BREF);
@@ -516,6 +916,11 @@ parse_directive(struct tokenizer_s * tk, rgx_tree * re)
       Q(lookup_group(tk, buf, false, &re->capindex));
       break;
     }
+    case D_BALANCED: {
+      if (isneg) return RGX_BAD_DIRECTIVE;
+      ESC_TYPE(TREE_BALANCED);
+      break;
+    }
     case D_SLASH:
     case D_CALL: {
       ESC_TYPE(isneg ? TREE_NPROC : TREE_PROC);
@@ -524,27 +929,18 @@ parse_directive(struct tokenizer_s * tk, rgx_tree * re)
       break;
     }
     case D_PROP: {
-      UErrorCode uec = U_ZERO_ERROR;
-      int i = 0;
-      buf[i++] = '\\';
-      buf[i++] = isneg ? 'P' : 'p';
-      buf[i++] = '{';
-      for (;;) {
-        buf[i] = (UChar)CUR;
-        if (++i >= 128) return RGX_BAD_DIRECTIVE;
-        if (CUR == '}') break;
-        NEXT; if (!MORE) return RGX_BAD_DIRECTIVE;
-      }
-      buf[i] = '\0';
+      const UChar * start = tk->iter.curp - U16_LENGTH(CUR);
+      while (CUR != '}') { NEXT; if (!MORE) return RGX_BAD_DIRECTIVE; }
+      if (tk->iter.curp - 1 - start >= 128) return RGX_BAD_DIRECTIVE;
       ESC_TYPE(TREE_SET);
-      re->chset = uset_openPattern(buf, i, &uec);
-      if (U_FAILURE(uec)) return RGX_BAD_DIRECTIVE;
+      Q(charset_property(tk, start, (size_t)(tk->iter.curp - 1 - start), isneg,
+                         RGX_BAD_DIRECTIVE, &re->chset));
       break;
     }
   }
   if (skip_spaces(tk) && CUR == '}') { NEXT; } else return RGX_MISSING_BRACE;
   return RGX_OK;
-#undef ESC_SET
+#undef ESC_CLS
 #undef ESC_TYPE
 }
 
@@ -582,13 +978,14 @@ parse_bracket(struct tokenizer_s * tk, rgx_tree ** re)
   UChar32 min = EOF;
   UChar32 op = EOF;
 
-  QN(rl->chset = uset_openEmpty());
+  QN(rl->chset = tk_set(tk, uset_openEmpty()));
 
   if (skip_spaces(tk) && CUR == '^') { NEXT; neg = true; }
 
   for (;;) {
     Q(parse_setchar(tk, rt, &found));
     if (found) {
+      Q(charset_of_class(rt));
       if (rt->type == TREE_CHAR) {
         uset_add(rl->chset, rt->chval);
         min = rt->chval;
@@ -611,6 +1008,7 @@ parse_bracket(struct tokenizer_s * tk, rgx_tree ** re)
       if (MORE && CUR == '[') { NEXT; Q(parse_bracket(tk, &rt)); }
       else return RGX_BAD_SET;
     }
+    Q(charset_of_class(rt));
 
     if (rt->type == TREE_CHAR) { /* [a-b] */
       if (op == '-' && min != EOF) uset_addRange(rl->chset, min, rt->chval);
@@ -620,9 +1018,11 @@ parse_bracket(struct tokenizer_s * tk, rgx_tree ** re)
         case '-': uset_removeAll(rl->chset, rt->chset); break;
         case '~': {
           USet * ins = uset_clone(rl->chset); /* ins = rl && rt */
+          QN(ins);
           uset_retainAll(ins, rt->chset);
           uset_addAll(rl->chset, rt->chset);
           uset_removeAll(rl->chset, ins);     /* rl = (rl || rt) - ins */
+          uset_close(ins);
           break;
         }
         case '&': uset_retainAll(rl->chset, rt->chset); break;
@@ -763,8 +1163,7 @@ parse_repeat(struct tokenizer_s * tk, rgx_tree ** re)
     else if (CUR == '+') { NEXT; rl = tree_new1(tk, TREE_PLUS, rl); }
     else if (CUR == '?') { NEXT; rl = tree_new1(tk, TREE_QUEST, rl); }
     else if (CUR == '{' && ((c = PEEK) == ',' || c == '}' ||
-                            uset_contains(ucat_digit, c) ||
-                            uset_contains(ucat_space, c))) {
+                            (uni_class(c) & (CLS_DIGIT | CLS_SPACE)))) {
       int min = 0;
       int max = 0;
       MAYBE_INT(min);
@@ -831,89 +1230,558 @@ parse_full(struct tokenizer_s * tk, rgx_tree ** re)
 /* ********************************************************************** */
 /* ********************************************************************** */
 
-typedef enum rgx_code_type_e {
-  OP_CHAR, OP_SET, OP_ANY, OP_NONE,
-  OP_BOL, OP_NBOL, OP_EOL, OP_NEOL,
-  OP_BOT, OP_NBOT, OP_EOT, OP_NEOT,
-  OP_WBND, OP_NWBND,
-  OP_LOOK, OP_NLOOK, OP_LOOKR, OP_NLOOKR,
-  OP_BREF, OP_NBREF, OP_QREF, OP_NQREF, OP_PROC, OP_NPROC,
-  OP_COND,
-  OP_JUMP, OP_SPLITLO, OP_SPLITHI,
-  OP_SAVE,
-  OP_MATCH,
-} rgx_code_type;
+/* Tree rewriting, done once before count() and emit().
+ *
+ *   (?a:(?a:x))  ->  (?a:x)
+ *   (x*)*        ->  x*           (only if both have the same greediness)
+ *   a|b|\d       ->  [ab\d]
+ *   ab|ac|d      ->  a(b|c)|d     (recursively, so word lists become tries)
+ *   one|two|...  ->  OP_TRIE      (RGX_TRIE_MIN or more literals)
+ *
+ * Every rewrite keeps leftmost-first priority, and frees at least as many
+ * nodes as it takes, so the node buffer's upper-bound still holds.
+ *
+ * Alternatives that start with different literals can't both match going
+ * forward, so a run of them may be sorted by first literal before being
+ * factored. That isn't true when the tree is emitted in reverse (look-behind
+ * and procedures), where only neighbouring alternatives are factored.
+ */
 
-typedef struct rgx_code_s rgx_code;
-struct rgx_code_s {
-  rgx_code_type opcode;
-  unsigned int generation;
-  union {
-    rgx_code * xaddr;   /* OP_SPLIT*, OP_JUMP, OP_*LOOK*, OP_PROC, OP_BREF, OP_QREF, OP_COND */
-    USet * xset;        /* OP_SET */
-    UChar32 literalc;   /* OP_CHAR */
-    struct {            /* OP_SAVE, OP_PROC, OP_BREF, OP_QREF, OP_COND */
-      index_t xsubidx;
-      bool rev;
-    } proc;
-  } u;
+struct branch_s {
+  rgx_tree * re;
+  UChar32 first; /* leading literal, or EOF */
+  size_t order;  /* original position, to keep the sort stable */
 };
-#define addr      u.xaddr
-#define subidx    u.proc.xsubidx
-#define reversed  u.proc.rev
-#define valc      u.literalc
-#define cset      u.xset
 
-typedef struct rgx_prog_s rgx_prog;
-struct rgx_prog_s {
-  size_t nameslen;
-  UChar ** names;
-  size_t len;
-  rgx_code * start;
+static void
+tree_free(struct tokenizer_s * tk, rgx_tree * re)
+{
+  re->left = tk->freenodes;
+  tk->freenodes = re;
+}
+
+/* the literal a concatenation starts with */
+static rgx_tree *
+tree_first(rgx_tree * re)
+{
+  while (re && re->type == TREE_CAT) re = re->left;
+  return (re && re->type == TREE_CHAR) ? re : NULL;
+}
+
+/* matches exactly one character from a set */
+static bool
+tree_single(rgx_tree * re)
+{
+  return re && (re->type == TREE_CHAR || re->type == TREE_SET || re->type == TREE_CLASS);
+}
+
+/* the concatenation without its first literal; the literal isn't freed */
+static rgx_tree *
+tree_rest(struct tokenizer_s * tk, rgx_tree * re)
+{
+  rgx_tree * rr;
+  if (re->type != TREE_CAT) return NULL;
+  if (re->left->type == TREE_CAT) {
+    re->left = tree_rest(tk, re->left);
+    return re;
+  }
+  rr = re->right;
+  tree_free(tk, re);
+  return rr;
+}
+
+static size_t
+alt_count(rgx_tree * re)
+{
+  if (re && re->type == TREE_ALT) return alt_count(re->left) + alt_count(re->right);
+  return 1;
+}
+
+static void
+alt_flatten(struct tokenizer_s * tk, rgx_tree * re, struct branch_s * buf, size_t * n)
+{
+  if (re && re->type == TREE_ALT) {
+    alt_flatten(tk, re->left, buf, n);
+    alt_flatten(tk, re->right, buf, n);
+    tree_free(tk, re);
+    return;
+  }
+  buf[*n].re = re;
+  buf[*n].order = *n;
+  (*n)++;
+}
+
+static int
+branch_cmp(const void * va, const void * vb)
+{
+  const struct branch_s * a = va;
+  const struct branch_s * b = vb;
+  if (a->first != b->first) return (a->first < b->first) ? -1 : 1;
+  return (a->order < b->order) ? -1 : (a->order > b->order);
+}
+
+/* A trie of literals, built for one direction. Nodes are numbered
+ * depth-first; each node's edges are contiguous and sorted.
+ */
+struct rgx_trie_s {
+  size_t nwords;
+  struct rgx_trie_node_s {
+    index_t edge;  /* first edge */
+    index_t nedge;
+    index_t word;  /* first word that ends here, or -1 */
+  } * nodes;
+  struct rgx_trie_edge_s {
+    UChar32 c;
+    index_t node;
+  } * edges;
 };
 
-#define EMIT(X)     (pc = emit(pc, (X), forward))
-#define EMITFWD(X)  (pc = emit(pc, (X), true))
-#define EMITREV(X)  (pc = emit(pc, (X), false))
+struct trie_word_s {
+  UChar32 * s;
+  size_t len;
+  index_t order;
+};
 
-static rgx_code * emit(rgx_code * pc, rgx_tree * re, bool forward);
+/* length of a literal string, or -1 if re isn't one */
+static long
+tree_literal_len(rgx_tree * re)
+{
+  long a, b;
+  if (!re) return 0;
+  if (re->type == TREE_CHAR) return 1;
+  if (re->type != TREE_CAT) return -1;
+  if ((a = tree_literal_len(re->left)) < 0) return -1;
+  if ((b = tree_literal_len(re->right)) < 0) return -1;
+  return a + b;
+}
 
-static rgx_code *
-emit_quest(rgx_code * pc, rgx_tree * re, int n, bool forward)
+static UChar32 *
+tree_literal_copy(rgx_tree * re, UChar32 * dst)
 {
-  /* 0. split 1,4
-   * 1. expr
-   * 2. split 3,4
-   * 3. expr
-   */
-  rgx_code * split;
-  split = pc++; split->opcode = OP_SPLITLO;
-  EMIT(re->left);
-  if (--n) pc = emit_quest(pc, re, n, forward);
-  split->addr = pc;
-  if (!re->repgreedy) split->opcode = OP_SPLITHI;
-  return pc;
+  if (!re) return dst;
+  if (re->type == TREE_CHAR) { *dst++ = re->chval; return dst; }
+  dst = tree_literal_copy(re->left, dst);
+  return tree_literal_copy(re->right, dst);
 }
 
-static rgx_code *
-emit(rgx_code * pc, rgx_tree * re, bool forward)
+/* The longest run of characters every match contains, for
+ * rgx_required_literal. Only what's certain counts: concatenations,
+ * groups, and the body of a repeat that runs at least once; anything else
+ * ends the run. Runs are laid out one after another in buf.
+ */
+struct required_s {
+  UChar32 * buf;
+  size_t cap;
+  size_t len;      /* of buf used */
+  size_t run;      /* where the current run starts */
+  size_t best;
+  size_t bestlen;
+};
+
+static void
+required_break(struct required_s * rq)
 {
-  rgx_code * split = NULL;
-  rgx_code * jump = NULL;
+  if (rq->len - rq->run > rq->bestlen) {
+    rq->best = rq->run;
+    rq->bestlen = rq->len - rq->run;
+  }
+  rq->run = rq->len;
+}
 
-  if (!re) return pc;
+static void
+required_walk(struct required_s * rq, const rgx_tree * re)
+{
+  if (!re) return;
   switch (re->type) {
-    case TREE_ALT: { /* 0. split 1,3; 1. expr1; 2. jump 4; 3. expr2 */
-      split = pc++; split->opcode = OP_SPLITLO;
-      EMIT(re->left);
-      jump = pc++; jump->opcode = OP_JUMP;
-      split->addr = pc;
-      EMIT(re->right);
-      jump->addr = pc;
+    case TREE_CHAR:
+      if (rq->len < rq->cap) rq->buf[rq->len++] = re->chval;
+      else required_break(rq);
       break;
-    }
-    case TREE_CAT: { /* 0. expr1; 1. expr2 */
-      if (forward) { EMIT(re->left); EMIT(re->right); }
+    case TREE_CAT:   required_walk(rq, re->left); required_walk(rq, re->right); break;
+    case TREE_GROUP: required_walk(rq, re->left); break;
+    case TREE_REPEAT:
+      if (re->repmin < 1) { required_break(rq); break; }
+      /* fall through */
+    case TREE_PLUS: /* the body is there at least once, but not what's round it */
+      required_break(rq);
+      required_walk(rq, re->left);
+      required_break(rq);
+      break;
+    default: required_break(rq); break;
+  }
+}
+
+static int
+trie_word_cmp(const void * va, const void * vb)
+{
+  const struct trie_word_s * a = va;
+  const struct trie_word_s * b = vb;
+  size_t i;
+  for (i = 0; i < a->len && i < b->len; ++i) {
+    if (a->s[i] != b->s[i]) return (a->s[i] < b->s[i]) ? -1 : 1;
+  }
+  if (a->len != b->len) return (a->len < b->len) ? -1 : 1;
+  return a->order - b->order;
+}
+
+/* w[0..n) are sorted and share their first 'depth' characters */
+static index_t
+trie_build(rgx_trie * tr, struct trie_word_s * w, size_t n, size_t depth,
+           index_t * nnodes, index_t * nedges)
+{
+  index_t node = (*nnodes)++;
+  index_t e;
+  size_t i, j, k;
+
+  tr->nodes[node].word = -1;
+  for (i = 0; i < n && w[i].len == depth; ++i) { /* shorter words sort first */
+    if (tr->nodes[node].word < 0) tr->nodes[node].word = w[i].order;
+  }
+  tr->nodes[node].edge = *nedges;
+  tr->nodes[node].nedge = 0;
+  for (j = i; j < n; j = k) {
+    for (k = j; k < n && w[k].s[depth] == w[j].s[depth]; ++k) continue;
+    tr->nodes[node].nedge++;
+  }
+  e = *nedges;
+  *nedges += tr->nodes[node].nedge;
+  for (j = i; j < n; j = k) {
+    for (k = j; k < n && w[k].s[depth] == w[j].s[depth]; ++k) continue;
+    tr->edges[e].c = w[j].s[depth];
+    tr->edges[e].node = trie_build(tr, w + j, k - j, depth + 1, nnodes, nedges);
+    e++;
+  }
+  return node;
+}
+
+/* Build from the literal trees re[0..n). Reversed tries hold each word
+ * backwards, for look-behind and reversed procedures.
+ */
+static rgx_error
+trie_new(struct tokenizer_s * tk, rgx_trie ** trie, struct branch_s * re, size_t n, bool forward)
+{
+  struct trie_word_s * w;
+  UChar32 * chars;
+  rgx_trie * tr;
+  size_t total = 0;
+  size_t i;
+  index_t nnodes = 0;
+  index_t nedges = 0;
+
+  for (i = 0; i < n; ++i) total += (size_t)tree_literal_len(re[i].re);
+  QN(w = arena_alloc(&tk->arena, n * sizeof(struct trie_word_s) + (total + 1) * sizeof(UChar32)));
+  chars = (UChar32 *)(w + n);
+  for (i = 0; i < n; ++i) {
+    w[i].s = chars;
+    chars = tree_literal_copy(re[i].re, chars);
+    w[i].len = (size_t)(chars - w[i].s);
+    w[i].order = (index_t)i;
+    if (!forward) {
+      size_t a = 0, b = w[i].len;
+      while (a + 1 < b) { UChar32 c = w[i].s[a]; w[i].s[a++] = w[i].s[--b]; w[i].s[b] = c; }
+    }
+  }
+  qsort(w, n, sizeof(struct trie_word_s), trie_word_cmp);
+
+  if (!arena_grow(&tk->arena, &tk->tries, sizeof(rgx_trie*), tk->trieslen, &tk->triescap))
+    return RGX_MEMORY;
+  QN(tr = MEM_ALLOC(tk->alloc, sizeof(rgx_trie)
+                               + (total + 1) * sizeof(struct rgx_trie_node_s)
+                               + total * sizeof(struct rgx_trie_edge_s)));
+  tk->tries[tk->trieslen++] = tr;
+  tr->nwords = n;
+  tr->nodes = (struct rgx_trie_node_s *)(tr + 1);
+  tr->edges = (struct rgx_trie_edge_s *)(tr->nodes + total + 1);
+  trie_build(tr, w, n, 0, &nnodes, &nedges);
+  *trie = tr;
+  return RGX_OK;
+}
+
+static rgx_error simplify(struct tokenizer_s * tk, rgx_tree ** rep, bool forward);
+
+/* alternation of in[0..n), any of which may itself be an alternation */
+static rgx_error
+simplify_alt(struct tokenizer_s * tk, rgx_tree ** in, size_t n, bool forward, rgx_tree ** re)
+{
+  struct branch_s * buf;
+  size_t len = 0;
+  size_t m = 0;
+  size_t i, j, k;
+
+  for (i = 0; i < n; ++i) len += alt_count(in[i]);
+  QN(buf = arena_alloc(&tk->arena, len * sizeof(struct branch_s)));
+  len = 0;
+  for (i = 0; i < n; ++i) alt_flatten(tk, in[i], buf, &len);
+
+  for (i = 0; i < len; ++i) {
+    rgx_tree * c;
+    Q(simplify(tk, &buf[i].re, forward));
+    c = tree_first(buf[i].re);
+    buf[i].first = c ? c->chval : EOF;
+  }
+
+  if (len >= RGX_TRIE_MIN) { /* one|two|three|... -> trie */
+    for (i = 0; i < len && tree_literal_len(buf[i].re) >= 0; ++i) continue;
+    if (i == len) {
+      rgx_tree * rl = tree_new(tk, TREE_TRIE);
+      rl->trierev = NULL;
+      Q(trie_new(tk, &rl->triefwd, buf, len, true));
+      if (!forward) Q(trie_new(tk, &rl->trierev, buf, len, false));
+      *re = rl;
+      return RGX_OK;
+    }
+  }
+
+  if (forward) { /* sort each run of literal-led branches by literal */
+    for (i = 0; i < len; i = j) {
+      for (j = i; j < len && buf[j].first != EOF; ++j) continue;
+      if (j - i > 1) qsort(buf + i, j - i, sizeof(struct branch_s), branch_cmp);
+      if (j == i) ++j;
+    }
+  }
+
+  for (i = 0; i < len; i = j) {
+    for (j = i + 1; j < len && buf[i].first != EOF && buf[j].first == buf[i].first; ++j) continue;
+    if (j - i > 1) { /* ab|ac -> a(b|c) */
+      rgx_tree * prefix = tree_first(buf[i].re);
+      rgx_tree ** rests;
+      rgx_tree * rr;
+      QN(rests = arena_alloc(&tk->arena, (j - i) * sizeof(rgx_tree*)));
+      for (k = i; k < j; ++k) {
+        rgx_tree * c = tree_first(buf[k].re);
+        rests[k - i] = tree_rest(tk, buf[k].re);
+        if (c != prefix) tree_free(tk, c);
+      }
+      Q(simplify_alt(tk, rests, j - i, forward, &rr));
+      buf[m].re = tree_new2(tk, TREE_CAT, prefix, rr);
+    } else {
+      buf[m].re = buf[i].re;
+    }
+    m++;
+  }
+
+  len = m;
+  m = 0;
+  for (i = 0; i < len; i = j) {
+    rgx_tree * rl = buf[i].re;
+    for (j = i + 1; j < len && tree_single(rl) && tree_single(buf[j].re); ++j) continue;
+    if (j - i > 1) { /* a|b|\d -> [ab\d] */
+      USet * set;
+      QN(set = tk_set(tk, uset_openEmpty()));
+      for (k = i; k < j; ++k) {
+        Q(charset_of_class(buf[k].re));
+        if (buf[k].re->type == TREE_CHAR) uset_add(set, buf[k].re->chval);
+        else uset_addAll(set, buf[k].re->chset);
+        if (k != i) tree_free(tk, buf[k].re);
+      }
+      rl->type = TREE_SET;
+      rl->chset = set;
+    }
+    buf[m++].re = rl;
+  }
+
+  *re = buf[--m].re;
+  while (m--) *re = tree_new2(tk, TREE_ALT, buf[m].re, *re);
+  return RGX_OK;
+}
+
+static rgx_error
+simplify(struct tokenizer_s * tk, rgx_tree ** rep, bool forward)
+{
+  rgx_tree * re = *rep;
+  rgx_tree * rl;
+  if (!re) return RGX_OK;
+  switch (re->type) {
+    case TREE_ALT: return simplify_alt(tk, rep, 1, forward, rep);
+    case TREE_CAT: {
+      Q(simplify(tk, &re->left, forward));
+      Q(simplify(tk, &re->right, forward));
+      break;
+    }
+    case TREE_GROUP: { /* (?a:(?a:x)) -> (?a:x) */
+      Q(simplify(tk, &re->left, forward));
+      rl = re->left;
+      if (rl && rl->type == TREE_GROUP && rl->capindex == re->capindex) {
+        re->left = rl->left;
+        tree_free(tk, rl);
+      }
+      break;
+    }
+    case TREE_QUEST:
+    case TREE_PLUS:
+    case TREE_STAR: { /* (x*)* (x+)* (x*)+ (x?)* ... -> x* */
+      Q(simplify(tk, &re->left, forward));
+      rl = re->left;
+      if (rl && (rl->type == TREE_QUEST || rl->type == TREE_PLUS || rl->type == TREE_STAR) &&
+          rl->repgreedy == re->repgreedy) {
+        if (rl->type != re->type) re->type = TREE_STAR; /* (x+)+ and (x?)? stay */
+        re->left = rl->left;
+        tree_free(tk, rl);
+      }
+      break;
+    }
+    case TREE_REPEAT: Q(simplify(tk, &re->left, forward)); break;
+    case TREE_LOOKA:
+    case TREE_NLOOKA: Q(simplify(tk, &re->left, true)); break;
+    case TREE_LOOKB:
+    case TREE_NLOOKB: Q(simplify(tk, &re->left, false)); break;
+    case TREE_COND: {
+      if (re->left && re->left->type == TREE_CAT) { /* not a real concatenation */
+        Q(simplify(tk, &re->left->left, forward));
+        Q(simplify(tk, &re->left->right, forward));
+      }
+      break;
+    }
+    default: break;
+  }
+  return RGX_OK;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+typedef enum rgx_code_type_e {
+  OP_CHAR, OP_SET, OP_CLASS, OP_ANY, OP_NONE,
+  OP_BOL, OP_NBOL, OP_EOL, OP_NEOL,
+  OP_BOT, OP_NBOT, OP_EOT, OP_NEOT,
+  OP_WBND, OP_NWBND,
+  OP_LOOK, OP_NLOOK, OP_LOOKR, OP_NLOOKR,
+  OP_PEEK, OP_NPEEK, OP_PEEKR, OP_NPEEKR, /* same order as OP_*LOOK* */
+  OP_BREF, OP_NBREF, OP_QREF, OP_NQREF, OP_PROC, OP_NPROC,
+  OP_COND, OP_TRIE, OP_BALANCED,
+  OP_JUMP, OP_SPLITLO, OP_SPLITHI,
+  OP_SAVE,
+  OP_MATCH,
+} rgx_code_type;
+
+typedef struct rgx_code_s rgx_code;
+struct rgx_code_s {
+  rgx_code_type opcode;
+  union {
+    rgx_code * xaddr;   /* OP_SPLIT*, OP_JUMP, OP_*LOOK*, OP_*PEEK*, OP_PROC, OP_BREF, OP_QREF, OP_COND */
+    USet * xset;        /* OP_SET */
+    rgx_trie * xtrie;   /* OP_TRIE */
+    struct {            /* OP_CLASS */
+      unsigned int xmask;
+      bool neg;
+    } cls;
+    UChar32 literalc;   /* OP_CHAR */
+    struct {            /* OP_SAVE, OP_PROC, OP_BREF, OP_QREF, OP_COND */
+      index_t xsubidx;
+      bool rev;
+    } proc;
+  } u;
+};
+#define addr      u.xaddr
+#define subidx    u.proc.xsubidx
+#define reversed  u.proc.rev
+#define valc      u.literalc
+#define cset      u.xset
+#define ctrie     u.xtrie
+
+struct rgx_prog_s {
+  size_t nameslen;
+  UChar ** names;
+  index_t * namehash;        /* indexes into names, -1 if empty; see rgx_group_index */
+  size_t namehashlen;        /* a power of two, at least twice nameslen */
+  UChar * required;          /* see rgx_required_literal; after the name data */
+  size_t requiredlen;
+  size_t len;
+  rgx_code * start;
+  struct telemetry_s * tele; /* null unless rgx_telemetry_enable'd */
+  rgx_analysis info;
+  rgx_allocator alloc;
+  void ** owned;             /* nsets USets, then ntries rgx_tries */
+  size_t nsets;
+  size_t ntries;
+};
+
+/* every program starts with .*? (see rgx_compile); this is its "any" */
+#define PREFIX_ANY(P)  ((P)->start + 1)
+
+#define EMIT(X)     (pc = emit(pc, (X), forward))
+#define EMITFWD(X)  (pc = emit(pc, (X), true))
+#define EMITREV(X)  (pc = emit(pc, (X), false))
+
+static rgx_code * emit(rgx_code * pc, rgx_tree * re, bool forward);
+
+static rgx_code *
+emit_quest(rgx_code * pc, rgx_tree * re, int n, bool forward)
+{
+  /* 0. split 1,4
+   * 1. expr
+   * 2. split 3,4
+   * 3. expr
+   */
+  rgx_code * split;
+  split = pc++; split->opcode = OP_SPLITLO;
+  EMIT(re->left);
+  if (--n) pc = emit_quest(pc, re, n, forward);
+  split->addr = pc;
+  if (!re->repgreedy) split->opcode = OP_SPLITHI;
+  return pc;
+}
+
+/* How many characters a look-around body always matches, if it's nothing
+ * but single characters and no more than RGX_PEEK_MAX of them; else 0.
+ * Such a body needs no threads: its opcodes are checked one by one
+ * against the input (see match_peek) instead of run by a nested rgx_exec1.
+ */
+static size_t
+peek_length(const rgx_tree * re)
+{
+  size_t a, b;
+  if (!re) return 0; /* (?=) */
+  switch (re->type) {
+    case TREE_CHAR: case TREE_SET: case TREE_CLASS: case TREE_ANY: return 1;
+    case TREE_CAT: {
+      if (!(a = peek_length(re->left)) || !(b = peek_length(re->right))) return 0;
+      return a + b <= RGX_PEEK_MAX ? a + b : 0;
+    }
+    case TREE_REPEAT: { /* x{n} is emitted as n x's */
+      if (re->repmin != re->repmax || re->repmin <= 0) return 0;
+      if (!(a = peek_length(re->left))) return 0;
+      return a * (size_t)re->repmin <= RGX_PEEK_MAX ? a * (size_t)re->repmin : 0;
+    }
+    default: return 0;
+  }
+}
+
+/* Finish a look-around: 0. look 3; 1. expr; 2. match; or, if the expr
+ * can be checked in place, 0. peek 2; 1. expr.
+ */
+static rgx_code *
+emit_lookend(rgx_code * pc, rgx_code * look, const rgx_tree * body)
+{
+  if (peek_length(body)) {
+    look->opcode = (rgx_code_type)(look->opcode - OP_LOOK + OP_PEEK);
+  } else {
+    pc->opcode = OP_MATCH;
+    pc++;
+  }
+  look->addr = pc;
+  return pc;
+}
+
+static rgx_code *
+emit(rgx_code * pc, rgx_tree * re, bool forward)
+{
+  rgx_code * split = NULL;
+  rgx_code * jump = NULL;
+
+  if (!re) return pc;
+  switch (re->type) {
+    case TREE_ALT: { /* 0. split 1,3; 1. expr1; 2. jump 4; 3. expr2 */
+      split = pc++; split->opcode = OP_SPLITLO;
+      EMIT(re->left);
+      jump = pc++; jump->opcode = OP_JUMP;
+      split->addr = pc;
+      EMIT(re->right);
+      jump->addr = pc;
+      break;
+    }
+    case TREE_CAT: { /* 0. expr1; 1. expr2 */
+      if (forward) { EMIT(re->left); EMIT(re->right); }
       else         { EMIT(re->right); EMIT(re->left); }
       break;
     }
@@ -958,29 +1826,25 @@ emit(rgx_code * pc, rgx_tree * re, bool forward)
     case TREE_LOOKA: { /* 0. lookahead 3; 1. expr; 2. match */
       jump = pc++; jump->opcode = forward ? OP_LOOK : OP_LOOKR;
       EMITFWD(re->left);
-      pc->opcode = OP_MATCH;
-      pc++; jump->addr = pc;
+      pc = emit_lookend(pc, jump, re->left);
       break;
     }
     case TREE_NLOOKA: { /* 0. lookahead 3; 1. expr; 2. match */
       jump = pc++; jump->opcode = forward ? OP_NLOOK : OP_NLOOKR;
       EMITFWD(re->left);
-      pc->opcode = OP_MATCH;
-      pc++; jump->addr = pc;
+      pc = emit_lookend(pc, jump, re->left);
       break;
     }
     case TREE_LOOKB: { /* 0. lookbehind 3; 1. expr; 2. match */
       jump = pc++; jump->opcode = forward ? OP_LOOKR : OP_LOOK;
       EMITREV(re->left);
-      pc->opcode = OP_MATCH;
-      pc++; jump->addr = pc;
+      pc = emit_lookend(pc, jump, re->left);
       break;
     }
     case TREE_NLOOKB: { /* 0. lookbehind 3; 1. expr; 2. match */
       jump = pc++; jump->opcode = forward ? OP_NLOOKR : OP_NLOOK;
       EMITREV(re->left);
-      pc->opcode = OP_MATCH;
-      pc++; jump->addr = pc;
+      pc = emit_lookend(pc, jump, re->left);
       break;
     }
     case TREE_COND: {
@@ -1025,7 +1889,24 @@ emit(rgx_code * pc, rgx_tree * re, bool forward)
       break;
     }
     case TREE_CHAR:  { pc->opcode = OP_CHAR; pc->valc = re->chval; pc++; break; }
-    case TREE_SET:   { pc->opcode = OP_SET;  pc->cset = re->chset; pc++; break; }
+    case TREE_SET:   {
+      pc->opcode = OP_SET; pc->cset = re->chset;
+      uset_freeze(pc->cset); /* faster contains, and safe to share */
+      pc++;
+      break;
+    }
+    case TREE_CLASS: {
+      pc->opcode = OP_CLASS; pc->clsmask = re->clsmask; pc->clsneg = re->clsneg;
+      pc++;
+      break;
+    }
+    case TREE_BALANCED: { pc->opcode = OP_BALANCED; pc++; break; }
+    case TREE_TRIE:  {
+      pc->opcode = OP_TRIE; pc->ctrie = forward ? re->triefwd : re->trierev;
+      assert(pc->ctrie != NULL);
+      pc++;
+      break;
+    }
     case TREE_ANY:   { pc->opcode = OP_ANY;  pc++; break; }
     case TREE_NONE:  { pc->opcode = OP_NONE; pc++; break; }
     case TREE_BOL:   { pc->opcode = forward ? OP_BOL  : OP_EOL;  pc++; break; }
@@ -1069,12 +1950,15 @@ count(rgx_tree * re, size_t * n)
     case TREE_NQREF:  break;
     case TREE_PROC:   break;
     case TREE_NPROC:  break;
-    case TREE_LOOKA:  a = 2; Q(count(re->left, &b)); break;
-    case TREE_NLOOKA: a = 2; Q(count(re->left, &b)); break;
-    case TREE_LOOKB:  a = 2; Q(count(re->left, &b)); break;
-    case TREE_NLOOKB: a = 2; Q(count(re->left, &b)); break;
+    case TREE_LOOKA:
+    case TREE_NLOOKA:
+    case TREE_LOOKB:
+    case TREE_NLOOKB: a = peek_length(re->left) ? 1 : 2; Q(count(re->left, &b)); break;
     case TREE_COND:   a = 3; Q(count(re->left->left, &b)); Q(count(re->left->right, &c)); break;
     case TREE_SET:    break;
+    case TREE_CLASS:  break;
+    case TREE_TRIE:   break;
+    case TREE_BALANCED: break;
     case TREE_ALT:    a = 2; Q(count(re->left, &b)); Q(count(re->right, &c)); break;
     case TREE_CAT:    a = 0; Q(count(re->left, &b)); Q(count(re->right, &c)); break;
     case TREE_GROUP:  a = 2; Q(count(re->left, &b)); break;
@@ -1100,100 +1984,418 @@ count(rgx_tree * re, size_t * n)
   return RGX_OK;
 }
 
-static UChar *
-rgx_strecpy(UChar * dst, const UChar * src)
+/* What a subtree can match, for rgx_analyze: its length range, how deep
+ * its look-arounds nest, and how many nested scans of the input deep it
+ * gets (each adds a factor of n to the worst case).
+ */
+struct shape_s {
+  size_t min, max;
+  size_t depth;
+  size_t scans;
+};
+
+struct analysis_s {
+  struct tokenizer_s * tk;
+  rgx_analysis * out;
+  struct proc_shape_s {
+    int state; /* 0 unseen, 1 being analyzed, 2 done */
+    struct shape_s shape;
+  } * procs;
+  bool looks;
+  bool calls;
+  bool balanced;
+};
+
+static size_t
+len_add(size_t a, size_t b)
 {
-  while (*src) *dst++ = *src++;
-  *dst = '\0';
-  return dst;
+  return (a == RGX_UNBOUNDED || b == RGX_UNBOUNDED || a + b < a) ? RGX_UNBOUNDED : a + b;
 }
 
-rgx_error
-rgx_compile(rgx_prog ** program, const UChar * pattern, size_t patlen)
+static size_t
+len_mul(size_t a, size_t n)
 {
-  rgx_prog * prog;
-  rgx_tree * rtree = NULL;
-  struct tokenizer_s tk;
+  if (a == 0 || n == 0) return 0;
+  return (a == RGX_UNBOUNDED || a > RGX_UNBOUNDED / n) ? RGX_UNBOUNDED : a * n;
+}
 
-  if (patlen >= RGX_LEN_MAX) return RGX_TOO_LONG;
+static void
+trie_shape(const rgx_trie * tr, index_t node, size_t len, struct shape_s * sh, size_t * nodes)
+{
+  const struct rgx_trie_node_s * nd = &tr->nodes[node];
+  index_t e;
+  ++*nodes;
+  if (nd->word >= 0) {
+    if (len < sh->min) sh->min = len;
+    if (len > sh->max) sh->max = len;
+  }
+  for (e = nd->edge; e < nd->edge + nd->nedge; ++e)
+    trie_shape(tr, tr->edges[e].node, len + 1, sh, nodes);
+}
 
-  if (!ucat_init) Q(init_charsets());
+/* a nested execution: look-around or procedure body */
+static struct shape_s
+nested_shape(struct shape_s body)
+{
+  struct shape_s sh = { 0, 0, body.depth, body.scans };
+  if (body.max == RGX_UNBOUNDED) sh.scans++; /* can run to the end of the input */
+  return sh;
+}
 
-  uni_iter_init(&tk.iter, pattern, patlen);
-  tk.cur = EOF;
-  /* tree node buffer */
-  tk.nodesidx = 0;
-  tk.nodeslen = patlen * 2 + 4;
-  QN(tk.nodes = malloc(tk.nodeslen * sizeof(rgx_tree))); /* upper-bound on tree nodes */
-  /* named capture groups */
-  tk.refs = NULL;
-  tk.refslen = 0;
-  { UChar nil = 0; Q(lookup_group(&tk, &nil, true, NULL)); } /* entire match */
-  /* procedures */
-  tk.procs = NULL;
-  tk.procslen = 0;
+static struct shape_s analyze(struct analysis_s * an, rgx_tree * re);
 
-  Q(parse_full(&tk, &rtree));
+static struct shape_s
+proc_shape(struct analysis_s * an, index_t idx)
+{
+  struct proc_shape_s * ps = &an->procs[idx];
+  an->calls = true;
+  if (ps->state == 1) { /* recursion; no bound on the length or the nesting */
+    struct shape_s sh = { 0, RGX_UNBOUNDED, 0, 0 };
+    an->out->recursive = true;
+    return sh;
+  }
+  if (ps->state == 0) {
+    ps->state = 1;
+    ps->shape = analyze(an, an->tk->procs[idx].body);
+    ps->state = 2;
+  }
+  return ps->shape;
+}
 
-  { /* integrity checking */
-    size_t i;
-    for (i = 0; i < tk.refslen; ++i) {
-      if (tk.refs[i].defined == false) return RGX_UNDEFINED;
+static struct shape_s
+analyze(struct analysis_s * an, rgx_tree * re)
+{
+  struct shape_s sh = { 0, 0, 0, 0 };
+  struct shape_s a, b;
+  if (!re) return sh;
+  switch (re->type) {
+    case TREE_CHAR:
+    case TREE_CLASS:
+    case TREE_ANY:
+    case TREE_NONE: sh.min = sh.max = 1; break;
+    case TREE_SET: {
+      UErrorCode err = U_ZERO_ERROR;
+      /* ICU doesn't say how big a set is; its serialized form is about the
+       * size of its range list, and a frozen set adds a ~1KB BMP table */
+      int32_t units = uset_serialize(re->chset, NULL, 0, &err);
+      an->out->sets++;
+      an->out->bytes += (size_t)units * sizeof(UChar32) + 1024;
+      sh.min = sh.max = 1;
+      break;
     }
-    for (i = 0; i < tk.procslen; ++i) {
-      if (tk.procs[i].body == NULL) {
-        printf("UNDEF: %s\n", ustr0(tk.procs[i].name));
-        return RGX_UNDEFINED;
+    case TREE_TRIE: {
+      size_t nodes = 0;
+      sh.min = RGX_UNBOUNDED;
+      trie_shape(re->triefwd, 0, 0, &sh, &nodes);
+      nodes = sizeof(rgx_trie) + nodes * sizeof(struct rgx_trie_node_s)
+              + (nodes - 1) * sizeof(struct rgx_trie_edge_s);
+      an->out->bytes += re->trierev ? nodes * 2 : nodes; /* same words either way */
+      break;
+    }
+    case TREE_BOL: case TREE_NBOL: case TREE_EOL: case TREE_NEOL:
+    case TREE_BOT: case TREE_NBOT: case TREE_EOT: case TREE_NEOT:
+    case TREE_WBND: case TREE_NWBND: break;
+    case TREE_LOOKA:
+    case TREE_NLOOKA:
+    case TREE_LOOKB:
+    case TREE_NLOOKB: {
+      an->looks = true;
+      sh = nested_shape(analyze(an, re->left));
+      sh.depth++;
+      break;
+    }
+    case TREE_BREF:
+    case TREE_QREF: /* compared against the whole capture at once */
+      an->out->backrefs = true;
+      sh.max = RGX_UNBOUNDED;
+      sh.scans = 1;
+      break;
+    case TREE_NBREF:
+    case TREE_NQREF:
+      an->out->backrefs = true;
+      sh.scans = 1;
+      break;
+    case TREE_BALANCED: /* isn't regular; the closes it scans for are kept, see match_balanced */
+      an->balanced = true;
+      sh.min = 2;
+      sh.max = RGX_UNBOUNDED;
+      break;
+    case TREE_PROC: {
+      a = proc_shape(an, re->procindex);
+      sh = nested_shape(a);
+      sh.min = a.min;
+      sh.max = a.max;
+      break;
+    }
+    case TREE_NPROC: sh = nested_shape(proc_shape(an, re->procindex)); break;
+    case TREE_COND: {
+      sh = nested_shape(proc_shape(an, re->procindex));
+      a = analyze(an, re->left->left);
+      b = analyze(an, re->left->right);
+      sh.min = a.min < b.min ? a.min : b.min;
+      sh.max = a.max > b.max ? a.max : b.max;
+      if (a.depth > sh.depth) sh.depth = a.depth;
+      if (b.depth > sh.depth) sh.depth = b.depth;
+      if (a.scans > sh.scans) sh.scans = a.scans;
+      if (b.scans > sh.scans) sh.scans = b.scans;
+      break;
+    }
+    case TREE_ALT:
+    case TREE_CAT: {
+      a = analyze(an, re->left);
+      b = analyze(an, re->right);
+      if (re->type == TREE_CAT) {
+        sh.min = len_add(a.min, b.min);
+        sh.max = len_add(a.max, b.max);
+      } else {
+        sh.min = a.min < b.min ? a.min : b.min;
+        sh.max = a.max > b.max ? a.max : b.max;
       }
+      sh.depth = a.depth > b.depth ? a.depth : b.depth;
+      sh.scans = a.scans > b.scans ? a.scans : b.scans;
+      break;
+    }
+    case TREE_GROUP: sh = analyze(an, re->left); break;
+    case TREE_QUEST: sh = analyze(an, re->left); sh.min = 0; break;
+    case TREE_STAR:
+    case TREE_PLUS: {
+      sh = analyze(an, re->left);
+      if (re->type == TREE_STAR) sh.min = 0;
+      if (sh.max) sh.max = RGX_UNBOUNDED;
+      break;
+    }
+    case TREE_REPEAT: {
+      sh = analyze(an, re->left);
+      sh.min = len_mul(sh.min, (size_t)re->repmin);
+      if (re->repmax == 0) { if (sh.max) sh.max = RGX_UNBOUNDED; }
+      else sh.max = len_mul(sh.max, (size_t)re->repmax);
+      break;
     }
   }
+  return sh;
+}
 
-  { /* .*?(regex) */
-    rgx_tree * cap = tree_new1(&tk, TREE_GROUP, rtree);
-    rgx_tree * rep = tree_new1(&tk, TREE_STAR, tree_new(&tk, TREE_ANY));
-    cap->capindex = 0;
-    rep->repgreedy = false;
-    rtree = tree_new2(&tk, TREE_CAT, rep, cap);
-  }
-  /* Go easy on our GC; put everything in the same alloc */
+/* fills in everything but the program's own size */
+static rgx_error
+analyze_pattern(struct tokenizer_s * tk, rgx_tree * re, rgx_analysis * out)
+{
+  struct analysis_s an;
+  struct shape_s sh;
+  size_t i;
+
+  memset(out, 0, sizeof(*out));
+  an.tk = tk;
+  an.out = out;
+  an.looks = an.calls = an.balanced = false;
+  QN(an.procs = arena_alloc(&tk->arena, (tk->procslen + 1) * sizeof(struct proc_shape_s)));
+  memset(an.procs, 0, (tk->procslen + 1) * sizeof(struct proc_shape_s));
+  sh = analyze(&an, re);
   {
-    size_t opcnt = 1 + (tk.procslen * 6);     /* match + [save...save match]*2 */
-    size_t nlen = tk.refslen * sizeof(UChar); /* \0 terminators */
-    size_t i;
-    for (i = 0; i < tk.refslen; ++i)
-      nlen += (size_t)u_strlen(tk.refs[i].name) * sizeof(UChar);
-    Q(count(rtree, &opcnt));
-    for (i = 0; i < tk.procslen; ++i) {
-      size_t n = 0;
-      Q(count(tk.procs[i].body, &n));
-      opcnt += n + n; /* forward and backward */
-      if (opcnt >= RGX_CODE_MAX) return RGX_TOO_LONG;
+    bool looks = an.looks, calls = an.calls, balanced = an.balanced;
+    bool recursive = out->recursive;
+    for (i = 0; i < tk->procslen; ++i) { /* procedures never called still take memory */
+      if (an.procs[i].state == 0) (void)proc_shape(&an, (index_t)i);
     }
-    QN(prog = malloc(sizeof(rgx_prog)                 /* root struct */
-                     + opcnt * sizeof(rgx_code)       /* compiled program */
-                     + tk.refslen * sizeof(UChar*)    /* pointers to name data */
-                     + nlen));                        /* name data */
+    an.looks = looks; an.calls = calls; an.balanced = balanced;
+    out->recursive = recursive;
   }
-  prog->start = (rgx_code*)(prog + 1);
-  { /* 0. jump 3; 1. proc; 2. match */
-    rgx_code * pc = prog->start;
-    pc = emit(pc, rtree, true);
-    pc->opcode = OP_MATCH;
-    pc++;
-    /* emit procedures, then patch addresses for procedure calls */
-    if (tk.procslen) {
-      rgx_code * patch = prog->start;
-      rgx_tree cap;
-      size_t i;
+
+  out->procs = tk->procslen;
+  out->min_len = sh.min;
+  out->max_len = sh.max;
+  out->look_depth = sh.depth;
+  out->engines = RGX_ENGINE_PIKE;
+  if (!out->backrefs) out->engines |= RGX_ENGINE_PARALLEL;
+  if (!out->backrefs && !an.looks && !an.calls && !an.balanced) out->engines |= RGX_ENGINE_DFA;
+  if (tree_literal_len(re) >= 0) out->engines |= RGX_ENGINE_LITERAL;
+  if (out->recursive) {
+    out->complexity = RGX_RECURSIVE;
+  } else {
+    out->degree = 1 + sh.scans;
+    out->complexity = sh.scans == 0 ? RGX_LINEAR : sh.scans == 1 ? RGX_QUADRATIC : RGX_POLYNOMIAL;
+  }
+  return RGX_OK;
+}
+
+static UChar *
+rgx_strecpy(UChar * dst, const UChar * src)
+{
+  while (*src) *dst++ = *src++;
+  *dst = '\0';
+  return dst;
+}
+
+static int
+ptr_cmp(const void * va, const void * vb)
+{
+  uintptr_t a = (uintptr_t)*(void * const *)va;
+  uintptr_t b = (uintptr_t)*(void * const *)vb;
+  return (a > b) - (a < b);
+}
+
+static bool
+ptr_find(void * const * sorted, size_t n, const void * p)
+{
+  return bsearch(&p, sorted, n, sizeof(void*), ptr_cmp) != NULL;
+}
+
+/* Hand the program the sets and tries it uses, and close the rest. */
+static rgx_error
+compile_own(struct tokenizer_s * tk, rgx_prog * prog)
+{
+  void ** used;
+  size_t nused = 0;
+  size_t i;
+
+  QN(used = arena_alloc(&tk->arena, (prog->len + 1) * sizeof(void*)));
+  for (i = 0; i < prog->len; ++i) {
+    if (prog->start[i].opcode == OP_SET) used[nused++] = prog->start[i].cset;
+    if (prog->start[i].opcode == OP_TRIE) used[nused++] = prog->start[i].ctrie;
+  }
+  qsort(used, nused, sizeof(void*), ptr_cmp);
+
+  for (i = 0; i < tk->setslen; ++i) prog->nsets += ptr_find(used, nused, tk->sets[i]);
+  for (i = 0; i < tk->trieslen; ++i) prog->ntries += ptr_find(used, nused, tk->tries[i]);
+  QN(prog->owned = MEM_ALLOC(tk->alloc, (prog->nsets + prog->ntries + 1) * sizeof(void*)));
+  prog->nsets = prog->ntries = 0;
+  for (i = 0; i < tk->setslen; ++i) {
+    if (ptr_find(used, nused, tk->sets[i])) prog->owned[prog->nsets++] = tk->sets[i];
+    else uset_close(tk->sets[i]);
+  }
+  for (i = 0; i < tk->trieslen; ++i) {
+    if (ptr_find(used, nused, tk->tries[i])) prog->owned[prog->nsets + prog->ntries++] = tk->tries[i];
+    else MEM_FREE(tk->alloc, tk->tries[i]);
+  }
+  tk->setslen = tk->trieslen = 0;
+  return RGX_OK;
+}
+
+/* Everything compile had that it didn't hand over: all of it if it failed */
+static void
+compile_close(struct tokenizer_s * tk)
+{
+  size_t i;
+  for (i = 0; i < tk->setslen; ++i) uset_close(tk->sets[i]);
+  for (i = 0; i < tk->trieslen; ++i) MEM_FREE(tk->alloc, tk->tries[i]);
+  if (tk->prog) {
+    if (tk->prog->owned) MEM_FREE(tk->alloc, tk->prog->owned);
+    MEM_FREE(tk->alloc, tk->prog);
+  }
+  arena_release(&tk->arena);
+}
+
+static rgx_error
+compile(struct tokenizer_s * tk, rgx_prog ** program, const UChar * pattern, size_t patlen)
+{
+  rgx_prog * prog;
+  rgx_tree * rtree = NULL;
+  rgx_analysis info;
+  struct required_s rq;
+  size_t rqlen = 0; /* in UTF-16 */
+
+  if (patlen >= RGX_LEN_MAX) return RGX_TOO_LONG;
+
+  uni_iter_init(&tk->iter, pattern, patlen);
+  tk->cur = EOF;
+  /* tree node buffer */
+  tk->nodesidx = 0;
+  tk->nodeslen = patlen * 2 + 4;
+  tk->freenodes = NULL;
+  QN(tk->nodes = arena_alloc(&tk->arena, tk->nodeslen * sizeof(rgx_tree))); /* upper-bound */
+  /* named capture groups */
+  { UChar nil = 0; Q(lookup_group(tk, &nil, true, NULL)); } /* entire match */
+
+  Q(parse_full(tk, &rtree));
+
+  { /* integrity checking */
+    size_t i;
+    for (i = 0; i < tk->refslen; ++i) {
+      if (tk->refs[i].defined == false) return RGX_UNDEFINED;
+    }
+    for (i = 0; i < tk->procslen; ++i) {
+      if (tk->procs[i].body == NULL) {
+        printf("UNDEF: %s\n", ustr0(tk->procs[i].name));
+        return RGX_UNDEFINED;
+      }
+    }
+  }
+
+  { /* rewrite; procedures are emitted both ways */
+    size_t i;
+    Q(simplify(tk, &rtree, true));
+    for (i = 0; i < tk->procslen; ++i) Q(simplify(tk, &tk->procs[i].body, false));
+  }
+  Q(analyze_pattern(tk, rtree, &info));
+  {
+    size_t i;
+    memset(&rq, 0, sizeof(rq));
+    rq.cap = tk->nodesidx; /* one per node is enough unless nodes are shared */
+    QN(rq.buf = arena_alloc(&tk->arena, (rq.cap + 1) * sizeof(UChar32)));
+    required_walk(&rq, rtree);
+    required_break(&rq);
+    for (i = 0; i < rq.bestlen; ++i) rqlen += (size_t)U16_LENGTH(rq.buf[rq.best + i]);
+  }
+
+  { /* .*?(regex) */
+    rgx_tree * cap = tree_new1(tk, TREE_GROUP, rtree);
+    rgx_tree * rep = tree_new1(tk, TREE_STAR, tree_new(tk, TREE_ANY));
+    cap->capindex = 0;
+    rep->repgreedy = false;
+    rtree = tree_new2(tk, TREE_CAT, rep, cap);
+  }
+  /* the program and its names in one allocation */
+  {
+    size_t opcnt = 1 + (tk->procslen * 6);     /* match + [save...save match]*2 */
+    size_t nlen = tk->refslen * sizeof(UChar); /* \0 terminators */
+    size_t hlen = 1;
+    size_t size;
+    size_t i;
+    for (i = 0; i < tk->refslen; ++i)
+      nlen += (size_t)u_strlen(tk->refs[i].name) * sizeof(UChar);
+    while (hlen < tk->refslen * 2) hlen *= 2;
+    Q(count(rtree, &opcnt));
+    for (i = 0; i < tk->procslen; ++i) {
+      size_t n = 0;
+      Q(count(tk->procs[i].body, &n));
+      opcnt += n + n; /* forward and backward */
+      if (opcnt >= RGX_CODE_MAX) return RGX_TOO_LONG;
+    }
+    size = sizeof(rgx_prog)                 /* root struct */
+           + opcnt * sizeof(rgx_code)       /* compiled program */
+           + tk->refslen * sizeof(UChar*)    /* pointers to name data */
+           + hlen * sizeof(index_t)         /* name hash */
+           + nlen                           /* name data */
+           + (rqlen + 1) * sizeof(UChar);   /* required literal */
+    QN(prog = MEM_ALLOC(tk->alloc, size));
+    prog->namehashlen = hlen;
+    info.bytes += size;
+  }
+  tk->prog = prog;
+  prog->alloc = *tk->alloc;
+  prog->owned = NULL;
+  prog->nsets = prog->ntries = 0;
+  prog->start = (rgx_code*)(prog + 1);
+  prog->tele = NULL;
+  prog->info = info;
+  { /* 0. jump 3; 1. proc; 2. match */
+    rgx_code * pc = prog->start;
+    pc = emit(pc, rtree, true);
+    pc->opcode = OP_MATCH;
+    pc++;
+    /* emit procedures, then patch addresses for procedure calls */
+    if (tk->procslen) {
+      rgx_code * patch = prog->start;
+      rgx_tree cap;
+      size_t i;
       cap.type = TREE_GROUP;
       cap.capindex = 0;
-      for (i = 0; i < tk.procslen; ++i) {
-        tk.procs[i].locfwd = pc;
-        cap.left = tk.procs[i].body;
+      for (i = 0; i < tk->procslen; ++i) {
+        tk->procs[i].locfwd = pc;
+        cap.left = tk->procs[i].body;
         pc = emit(pc, &cap, true);
         pc->opcode = OP_MATCH;
         pc++;
-        tk.procs[i].locrev = pc;
+        tk->procs[i].locrev = pc;
         pc = emit(pc, &cap, false);
         pc->opcode = OP_MATCH;
         pc++;
@@ -1201,27 +2403,83 @@ rgx_compile(rgx_prog ** program, const UChar * pattern, size_t patlen)
       while (patch < pc) {
         if (patch->opcode == OP_PROC || patch->opcode == OP_NPROC ||
             patch->opcode == OP_COND)
-          patch->addr = patch->reversed ? tk.procs[patch->subidx].locrev
-                                        : tk.procs[patch->subidx].locfwd;
+          patch->addr = patch->reversed ? tk->procs[patch->subidx].locrev
+                                        : tk->procs[patch->subidx].locfwd;
         patch++;
       }
     }
     prog->len = (size_t)(pc - prog->start);
     prog->names = (UChar **)pc;
+    prog->info.opcodes = prog->len;
   }
-  prog->nameslen = tk.refslen;
+  prog->nameslen = tk->refslen;
+  prog->namehash = (index_t *)(prog->names + tk->refslen);
   {
-    UChar * p = (UChar *)(prog->names + tk.refslen);
-    size_t i;
-    for (i = 0; i < tk.refslen; ++i) {
+    UChar * p = (UChar *)(prog->namehash + prog->namehashlen);
+    size_t mask = prog->namehashlen - 1;
+    size_t i, h;
+    for (i = 0; i < prog->namehashlen; ++i) prog->namehash[i] = -1;
+    for (i = 0; i < tk->refslen; ++i) {
       prog->names[i] = p;
-      p = rgx_strecpy(p, tk.refs[i].name) + 1;
+      p = rgx_strecpy(p, tk->refs[i].name) + 1;
+      for (h = name_hash(prog->names[i]) & mask; prog->namehash[h] >= 0; h = (h + 1) & mask) { }
+      prog->namehash[h] = (index_t)i;
+    }
+    prog->required = p;
+    prog->requiredlen = rqlen;
+    for (i = 0; i < rq.bestlen; ++i) {
+      UChar32 c = rq.buf[rq.best + i];
+      if (U_IS_BMP(c)) *p++ = (UChar)c;
+      else { *p++ = U16_LEAD(c); *p++ = U16_TRAIL(c); }
     }
+    *p = 0;
   }
+  Q(compile_own(tk, prog));
+  tk->prog = NULL;
   *program = prog;
   return RGX_OK;
 }
 
+/* Safe to call from several threads at once: the shared tables are set up
+ * once, and each compile otherwise only touches its own memory.
+ * The compiled program is read-only to rgx_exec, so it can be shared.
+ */
+rgx_error
+rgx_compile_with(rgx_prog ** program, const UChar * pattern, size_t patlen,
+                 const rgx_allocator * alloc)
+{
+  struct tokenizer_s tk;
+  rgx_error err;
+  PROBE2(compile_start, pattern, patlen);
+  memset(&tk, 0, sizeof(tk));
+  tk.alloc = tk.arena.alloc = alloc ? alloc : &libc_allocator;
+  err = compile(&tk, program, pattern, patlen);
+  compile_close(&tk);
+  PROBE3(compile_done, patlen, err ? 0 : (*program)->len, err);
+  return err;
+}
+
+rgx_error
+rgx_compile(rgx_prog ** program, const UChar * pattern, size_t patlen)
+{
+  return rgx_compile_with(program, pattern, patlen, NULL);
+}
+
+static void telemetry_forget(rgx_prog * prog);
+
+/* Not while anything is still matching against it */
+void
+rgx_free(rgx_prog * prog)
+{
+  size_t i;
+  if (!prog) return;
+  telemetry_forget(prog);
+  for (i = 0; i < prog->nsets; ++i) uset_close(prog->owned[i]);
+  for (i = 0; i < prog->ntries; ++i) MEM_FREE(&prog->alloc, prog->owned[prog->nsets + i]);
+  MEM_FREE(&prog->alloc, prog->owned);
+  MEM_FREE(&prog->alloc, prog);
+}
+
 UChar **
 rgx_group_names(rgx_prog * prog)
 {
@@ -1234,6 +2492,34 @@ rgx_group_count(rgx_prog * prog)
   return prog->nameslen;
 }
 
+size_t
+rgx_group_index(rgx_prog * prog, const UChar * name)
+{
+  size_t mask = prog->namehashlen - 1;
+  size_t h;
+  for (h = name_hash(name) & mask; prog->namehash[h] >= 0; h = (h + 1) & mask) {
+    if (!u_strcmp(prog->names[prog->namehash[h]], name)) return (size_t)prog->namehash[h];
+  }
+  return RGX_NO_GROUP;
+}
+
+/* The longest string every match contains, so callers can skip inputs
+ * without it before matching; len gets its length in code units, 0 if
+ * there's nothing to look for.
+ */
+const UChar *
+rgx_required_literal(rgx_prog * prog, size_t * len)
+{
+  *len = prog->requiredlen;
+  return prog->required;
+}
+
+void
+rgx_analyze(rgx_prog * prog, rgx_analysis * out)
+{
+  *out = prog->info;
+}
+
 static void
 charset_print(USet * s)
 {
@@ -1243,8 +2529,22 @@ charset_print(USet * s)
   printf("%s", ustr0(buf));
 }
 
+size_t
+rgx_prog_length(rgx_prog * prog)
+{
+  return prog->len;
+}
+
 void
 rgx_print_prog(rgx_prog * prog)
+{
+  rgx_print_prog_stats(prog, NULL);
+}
+
+/* with a profile from rgx_exec_with_stats, each line is prefixed with
+ * its counters: added, consumed, dropped, and microseconds nested */
+void
+rgx_print_prog_stats(rgx_prog * prog, const rgx_pc_stats * pcs)
 {
   rgx_code * start = prog->start;
   rgx_code * end = start + prog->len;
@@ -1254,12 +2554,19 @@ rgx_print_prog(rgx_prog * prog)
   printf("groups: %u [ ", (unsigned)(prog->nameslen));
   for (i = 0; i < prog->nameslen; ++i) printf("'%s' ", ustr0(prog->names[i]));
   printf("]\n");
+  if (pcs) printf("    %9s %9s %9s %9s\n", "added", "consumed", "dropped", "nested us");
   for (; pc < end; pc++) {
     printf("%2u. ", (unsigned)(pc - start));
+    if (pcs) {
+      const rgx_pc_stats * ps = &pcs[pc - start];
+      printf("%9lu %9lu %9lu %9.1f  ", (unsigned long)ps->added, (unsigned long)ps->consumed,
+             (unsigned long)ps->dropped, (double)ps->nested_ns / 1000.0);
+    }
     switch (pc->opcode) {
       case OP_MATCH:  printf("match"); break;
       case OP_CHAR:   printf("char '%c'", pc->valc); break;
       case OP_SET:    printf("set "); charset_print(pc->cset); break;
+      case OP_CLASS:  printf("class %s%s", pc->clsneg ? "^" : "", charset_class_name(pc->clsmask)); break;
       case OP_ANY:    printf("char any"); break;
       case OP_NONE:   printf("char none"); break;
       case OP_BOL:    printf("line begin"); break;
@@ -1282,7 +2589,13 @@ rgx_print_prog(rgx_prog * prog)
       case OP_NLOOK:  printf("negative look-ahead %lu", (unsigned long)(pc->addr - start)); break;
       case OP_LOOKR:  printf("look-behind %lu", (unsigned long)(pc->addr - start)); break;
       case OP_NLOOKR: printf("negative look-behind %lu", (unsigned long)(pc->addr - start)); break;
+      case OP_PEEK:   printf("peek-ahead %lu", (unsigned long)(pc->addr - start)); break;
+      case OP_NPEEK:  printf("negative peek-ahead %lu", (unsigned long)(pc->addr - start)); break;
+      case OP_PEEKR:  printf("peek-behind %lu", (unsigned long)(pc->addr - start)); break;
+      case OP_NPEEKR: printf("negative peek-behind %lu", (unsigned long)(pc->addr - start)); break;
       case OP_COND:   printf("cond %lu", (unsigned long)(pc->addr - start)); break;
+      case OP_TRIE:   printf("trie (%u words)", (unsigned)pc->ctrie->nwords); break;
+      case OP_BALANCED: printf("balanced"); break;
       case OP_JUMP:   printf("jump %lu", (unsigned long)(pc->addr - start)); break;
       case OP_SPLITLO:printf("split lo %lu", (unsigned long)(pc->addr - start)); break;
       case OP_SPLITHI:printf("split hi %lu", (unsigned long)(pc->addr - start)); break;
@@ -1295,28 +2608,316 @@ rgx_print_prog(rgx_prog * prog)
 /* ********************************************************************** */
 /* ********************************************************************** */
 
+static uint64_t
+clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+/* Per-pattern telemetry. A registered program points at its counters,
+ * which every thread matching it adds to atomically; the registry is a
+ * list, and rgx_free takes a program back off it.
+ */
+struct telemetry_s {
+  rgx_prog * prog;
+  char * name;
+  unsigned int sample; /* time 1 in this many */
+  size_t execs;        /* the rest are atomic */
+  size_t matches;
+  size_t bytes;
+  size_t timed;
+  uint64_t ns;
+  uint64_t worst_ns;
+  struct telemetry_s * next;
+};
+
+static struct telemetry_s * telemetry_list;
+static pthread_mutex_t telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool
+rgx_telemetry_enable(rgx_prog * prog, const char * name, unsigned int sample)
+{
+  struct telemetry_s * t;
+  size_t namelen = strlen(name ? name : "");
+  bool ok = true;
+  pthread_mutex_lock(&telemetry_lock);
+  if (!prog->tele) {
+    /* one block, the name after the record, from the program's allocator */
+    if ((t = MEM_ALLOC(&prog->alloc, sizeof(*t) + namelen + 1)) != NULL) {
+      memset(t, 0, sizeof(*t));
+      t->name = (char *)(t + 1);
+      memcpy(t->name, name ? name : "", namelen + 1);
+      t->prog = prog;
+      t->sample = sample ? sample : 1;
+      t->next = telemetry_list;
+      telemetry_list = t;
+      __atomic_store_n(&prog->tele, t, __ATOMIC_RELEASE);
+    } else {
+      ok = false;
+    }
+  }
+  pthread_mutex_unlock(&telemetry_lock);
+  return ok;
+}
+
+static void
+telemetry_forget(rgx_prog * prog)
+{
+  struct telemetry_s ** tp;
+  if (!prog->tele) return;
+  pthread_mutex_lock(&telemetry_lock);
+  for (tp = &telemetry_list; *tp; tp = &(*tp)->next) {
+    if (*tp == prog->tele) {
+      *tp = prog->tele->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&telemetry_lock);
+  MEM_FREE(&prog->alloc, prog->tele);
+  prog->tele = NULL;
+}
+
+static void
+telemetry_read(const struct telemetry_s * t, rgx_telemetry * out)
+{
+  out->prog = t->prog;
+  strncpy(out->name, t->name, sizeof(out->name) - 1);
+  out->name[sizeof(out->name) - 1] = '\0';
+  out->sample = t->sample;
+  out->execs = __atomic_load_n(&t->execs, __ATOMIC_RELAXED);
+  out->matches = __atomic_load_n(&t->matches, __ATOMIC_RELAXED);
+  out->bytes = __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+  out->timed = __atomic_load_n(&t->timed, __ATOMIC_RELAXED);
+  out->ns = __atomic_load_n(&t->ns, __ATOMIC_RELAXED);
+  out->worst_ns = __atomic_load_n(&t->worst_ns, __ATOMIC_RELAXED);
+}
+
+bool
+rgx_telemetry_get(rgx_prog * prog, rgx_telemetry * out)
+{
+  struct telemetry_s * t = __atomic_load_n(&prog->tele, __ATOMIC_ACQUIRE);
+  if (!t) return false;
+  telemetry_read(t, out);
+  return true;
+}
+
+/* copies up to max snapshots; returns how many patterns are registered */
+size_t
+rgx_telemetry_list(rgx_telemetry * out, size_t max)
+{
+  struct telemetry_s * t;
+  size_t n = 0;
+  pthread_mutex_lock(&telemetry_lock);
+  for (t = telemetry_list; t; t = t->next, ++n) {
+    if (n < max) telemetry_read(t, &out[n]);
+  }
+  pthread_mutex_unlock(&telemetry_lock);
+  return n;
+}
+
+/* the estimated total: mean timed latency times executions */
+static double
+telemetry_cost(const rgx_telemetry * t)
+{
+  return t->timed ? (double)t->ns / (double)t->timed * (double)t->execs : 0.0;
+}
+
+static int
+telemetry_cmp(const void * va, const void * vb)
+{
+  double a = telemetry_cost(va);
+  double b = telemetry_cost(vb);
+  return (a < b) - (a > b);
+}
+
+/* costliest first */
+bool
+rgx_telemetry_dump(FILE * fp, bool json)
+{
+  rgx_telemetry * all;
+  size_t n = rgx_telemetry_list(NULL, 0), got, i;
+  if (!(all = malloc((n ? n : 1) * sizeof(rgx_telemetry)))) return false;
+  got = rgx_telemetry_list(all, n);
+  if (got < n) n = got; /* ignore any registered since, and any freed */
+  qsort(all, n, sizeof(rgx_telemetry), telemetry_cmp);
+
+  if (json) fprintf(fp, "[");
+  else fprintf(fp, "%-24s %10s %10s %12s %8s %10s %10s %12s\n", "pattern", "execs",
+               "matches", "bytes", "timed", "mean us", "worst us", "est. ms");
+  for (i = 0; i < n; ++i) {
+    const rgx_telemetry * t = &all[i];
+    double mean = t->timed ? (double)t->ns / (double)t->timed / 1000.0 : 0.0;
+    if (json) {
+      const char * c;
+      fprintf(fp, "%s\n  {\"name\": \"", i ? "," : "");
+      for (c = t->name; *c; ++c) {
+        if (*c == '"' || *c == '\\') fputc('\\', fp);
+        if ((unsigned char)*c < ' ') fprintf(fp, "\\u%04x", *c);
+        else fputc(*c, fp);
+      }
+      fprintf(fp, "\", \"execs\": %lu, \"matches\": %lu, \"bytes\": %lu, \"sample\": %u, "
+              "\"timed\": %lu, \"ns\": %lu, \"worst_ns\": %lu, \"est_total_ns\": %.0f}",
+              (unsigned long)t->execs, (unsigned long)t->matches, (unsigned long)t->bytes,
+              t->sample, (unsigned long)t->timed, (unsigned long)t->ns,
+              (unsigned long)t->worst_ns, telemetry_cost(t));
+    } else {
+      fprintf(fp, "%-24.24s %10lu %10lu %12lu %8lu %10.2f %10.2f %12.3f\n", t->name,
+              (unsigned long)t->execs, (unsigned long)t->matches, (unsigned long)t->bytes,
+              (unsigned long)t->timed, mean, (double)t->worst_ns / 1000.0,
+              telemetry_cost(t) / 1e6);
+    }
+  }
+  if (json) fprintf(fp, "\n]\n");
+  free(all);
+  return true;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
 typedef struct rgx_submatch_s rgx_submatch;
 struct rgx_submatch_s {
   int ref;
   UChar * ptrs[1];
 };
 
+#define RGX_CLOCK_EVERY  (256)  /* steps between looks at the clock */
+
+/* What's left of an rgx_exec*_limited call's limits; shared with nested
+ * matchers */
+struct budget_s {
+  rgx_limits lim;
+  size_t steps;
+  size_t scratch;      /* bytes of thread lists and submatches held */
+  uint64_t deadline;   /* clock_ns() */
+  unsigned int tick;   /* steps until the clock is looked at */
+  rgx_result stop;     /* RGX_NO_MATCH until a limit is passed */
+};
+
+/* Where a {balanced} starting at open ends, or null if it doesn't; see
+ * match_balanced */
+struct balkey_s {
+  const UChar * open;   /* null if the slot is empty */
+  const UChar * end;
+  bool reverse;
+};
+
+/* A paused thread pushed in generation gen; see pause_seen */
+struct pausekey_s {
+  unsigned int gen;
+  index_t pc;
+  const UChar * resume;
+};
+
 struct matcher_s {
   rgx_prog * prog;
+  const rgx_allocator * alloc;
+  unsigned int * marks;   /* per pc: the generation it was last added in */
   unsigned int generation;
+  unsigned int * lastgen; /* shared with nested matchers, so marks never repeat */
   uni_iter iter;
   UChar32 cur;
+  unsigned int curcls;  /* CLS_* of CUR and PEEK, filled in on demand */
+  unsigned int peekcls;
   bool reverse;
   size_t nsubs;
   rgx_submatch * freesub;
+  const UChar * startlimit; /* if set, no match may start at or after it */
+  struct budget_s * budget; /* null if unlimited */
+  size_t depth;             /* of nested execution */
+  bool nomem;               /* an allocation failed; the search gives up */
+  struct pausekey_s * paused; /* see pause_seen */
+  size_t pausedcap;
+  size_t pausedlen;
+  unsigned int pausedgen;
+  struct balkey_s * balanced; /* see match_balanced */
+  size_t balancedcap;
+  size_t balancedlen;
+  uni_iter balancedin;        /* the input they're for */
+#ifdef RGX_STATS
+  rgx_exec_stats * stats;   /* null if not counting */
+#endif
 };
 
+/* Each of these returns false, with the reason in stop, once a limit is
+ * passed. Scratch memory can overshoot by what one step allocates; the
+ * matcher only stops between steps.
+ */
+static bool
+budget_step(struct budget_s * bg)
+{
+  if (bg->stop) return false;
+  if (bg->lim.steps && ++bg->steps > bg->lim.steps) {
+    bg->stop = RGX_STEP_LIMIT;
+  } else if (bg->lim.time_ns && --bg->tick == 0) {
+    bg->tick = RGX_CLOCK_EVERY;
+    if (clock_ns() >= bg->deadline) bg->stop = RGX_TIME_LIMIT;
+  }
+  return !bg->stop;
+}
+
+/* A fresh call's limits. What's held is left alone: a matcher that's
+ * reused keeps its caches, and they're freed against this count later.
+ */
+static void
+budget_start(struct budget_s * bg, const rgx_limits * limits)
+{
+  bg->lim = *limits;
+  bg->steps = 0;
+  bg->tick = RGX_CLOCK_EVERY;
+  bg->deadline = limits->time_ns ? clock_ns() + limits->time_ns : 0;
+  bg->stop = RGX_NO_MATCH;
+}
+
+static bool
+budget_nest(struct budget_s * bg, size_t depth)
+{
+  if (!bg->stop && bg->lim.depth && depth > bg->lim.depth) bg->stop = RGX_DEPTH_LIMIT;
+  return !bg->stop;
+}
+
+static void
+budget_alloc(struct budget_s * bg, size_t bytes, bool freed)
+{
+  if (freed) { bg->scratch -= bytes; return; }
+  bg->scratch += bytes;
+  if (!bg->stop && bg->lim.scratch && bg->scratch > bg->lim.scratch)
+    bg->stop = RGX_SCRATCH_LIMIT;
+}
+
+#define BUDGET_ALLOC(MM,N,FREED)  do{ if ((MM)->budget) budget_alloc((MM)->budget, (N), (FREED)); }while(0)
+
+/* Counting for rgx_exec_with_stats. X is run with st_ pointing at the
+ * counters, or for PCSTAT, ps_ at those of pc PC; without RGX_STATS none
+ * of it is compiled at all.
+ */
+#ifdef RGX_STATS
+#define STAT(MM,X)  do{ rgx_exec_stats * st_ = (MM)->stats; if (st_) { X; } }while(0)
+#define PCSTAT(MM,PC,X) \
+  STAT(MM, if (st_->pcs) { rgx_pc_stats * ps_ = &st_->pcs[(PC) - (MM)->prog->start]; X; })
+#define IF_STATS(X)  X
+#else
+#define STAT(MM,X)       do{ }while(0)
+#define PCSTAT(MM,PC,X)  do{ }while(0)
+#define IF_STATS(X)
+#endif
+
 static rgx_submatch *
 sub_new(struct matcher_s * mm)
 {
   rgx_submatch * s = mm->freesub;
+  STAT(mm, st_->sub_news++; if (!s) st_->sub_allocs++);
   if (s != NULL) mm->freesub = (rgx_submatch*)s->ptrs[0];
-  else s = malloc(sizeof(rgx_submatch) + mm->nsubs * sizeof(UChar*));
+  else {
+    s = MEM_ALLOC(mm->alloc, sizeof(rgx_submatch) + mm->nsubs * sizeof(UChar*));
+    if (!s) { mm->nomem = true; return NULL; }
+    BUDGET_ALLOC(mm, sizeof(rgx_submatch) + mm->nsubs * sizeof(UChar*), false);
+  }
   s->ref = 1;
   return s;
 }
@@ -1337,6 +2938,8 @@ sub_update(struct matcher_s * mm, rgx_submatch * s, size_t i)
 {
   if (s->ref > 1) {
     rgx_submatch * s1 = sub_new(mm);
+    if (!s1) return s; /* still shared, so left as it was; the search gives up */
+    STAT(mm, st_->sub_copies++);
     memcpy(s1->ptrs, s->ptrs, mm->nsubs * sizeof(UChar*));
     s->ref--;
     s = s1;
@@ -1358,62 +2961,470 @@ struct rgx_thread_s {
 #define thread_new(PC,SUB)            ((rgx_thread){ (PC), NULL,     (SUB) })
 #define thread_paused(PC,RESUME,SUB)  ((rgx_thread){ (PC), (RESUME), (SUB) })
 
+/* Paused threads ahead of every other thread in the list. They're kept
+ * aside, shared by both lists, so they aren't copied from one list to the
+ * next at every step; wake[i] is the nearest resume of threads[0..i], to
+ * see when any of them is due. Threads that pause and resume in stack
+ * order, as nested brace pairs do under {balanced}, only ever come off
+ * the top.
+ */
+struct sleepers_s {
+  size_t len;
+  size_t cap;
+  rgx_thread * threads;
+  const UChar ** wake;
+};
+
 typedef struct rgx_threadlist_s rgx_threadlist;
 struct rgx_threadlist_s {
   size_t len;
+  size_t cap;
   rgx_thread * threads;
+  size_t npaused;       /* how many of them are paused */
+  const UChar * wake;   /* the nearest resume of those */
+  struct sleepers_s * front; /* paused threads ahead of all of these */
 };
 
-#define MATCH(EX)  do{ if (EX) goto keep_thread; else goto drop_thread; }while(0)
-#define NMATCH(EX) do{ if (EX) goto drop_thread; else goto keep_thread; }while(0)
-#define MATCHJ(EX) do{ if (EX) goto jump_thread; else goto drop_thread; }while(0)
-#undef MORE
-#undef CUR
-#undef NEXT
-#undef PEEK
-#define MORE  (mm->cur != EOF)
-#define CUR   (mm->cur)
-#define NEXT  (mm->cur = mm->reverse ? uni_iter_prev(&mm->iter) : uni_iter_next(&mm->iter))
-#define PEEK  (mm->reverse ? uni_iter_rpeek(&mm->iter) : uni_iter_peek(&mm->iter))
+static size_t
+pause_hash(index_t pc, const UChar * resume)
+{
+  return ((size_t)pc * 0x9E3779B1u) ^ ((size_t)(uintptr_t)resume >> 1) * 0x85EBCA77u;
+}
 
-static bool rgx_exec1(struct matcher_s * mm, rgx_code * pc, rgx_submatch ** sub);
+static struct pausekey_s *
+pause_slot(struct matcher_s * mm, index_t pc, const UChar * resume)
+{
+  size_t mask = mm->pausedcap - 1;
+  size_t i = pause_hash(pc, resume) & mask;
+  while (mm->paused[i].gen == mm->generation &&
+         (mm->paused[i].pc != pc || mm->paused[i].resume != resume)) i = (i + 1) & mask;
+  return &mm->paused[i];
+}
 
 static bool
-match_backref(struct matcher_s * mm, bool quoted, rgx_thread t, const UChar ** resume)
+pause_grow(struct matcher_s * mm)
 {
-  const UChar * ref = t.sub->ptrs[t.pc->subidx];
-  const UChar * end = t.sub->ptrs[t.pc->subidx + 1];
-  size_t n;
-  if (!ref || !end) return false; /* failed submatch */
-  n = (size_t)(end - ref);
-  if (mm->reverse) {
-    if ((size_t)(mm->iter.curp - mm->iter.startp) < n) return false;
-    if (quoted ? !uni_quote_equal(mm->iter.curp - n, ref, n)
-               : u_memcmp(mm->iter.curp - n, ref, (int32_t)n)) return false;
-    if (resume) *resume = mm->iter.curp - n;
-  } else {
-    if ((size_t)(mm->iter.endp - mm->iter.curp) < n) return false;
-    if (quoted ? !uni_quote_equal(mm->iter.curp, ref, n)
-               : u_memcmp(mm->iter.curp, ref, (int32_t)n)) return false;
-    if (resume) *resume = mm->iter.curp + n;
+  struct pausekey_s * old = mm->paused;
+  size_t oldcap = mm->pausedcap;
+  size_t i;
+  size_t cap = oldcap ? oldcap * 2 : 64;
+  if (!(mm->paused = MEM_ALLOC(mm->alloc, cap * sizeof(struct pausekey_s)))) {
+    mm->paused = old;
+    return false;
+  }
+  BUDGET_ALLOC(mm, cap * sizeof(struct pausekey_s), false);
+  memset(mm->paused, 0, cap * sizeof(struct pausekey_s)); /* generation 0 is never current */
+  mm->pausedcap = cap;
+  for (i = 0; i < oldcap; ++i) {
+    if (old[i].gen == mm->generation) *pause_slot(mm, old[i].pc, old[i].resume) = old[i];
+  }
+  if (old) {
+    BUDGET_ALLOC(mm, oldcap * sizeof(struct pausekey_s), true);
+    MEM_FREE(mm->alloc, old);
   }
   return true;
 }
 
-#define RECURSE(DST,REV) do{ \
-  struct matcher_s mmtmp_ = *mm; \
-  mm->reverse = (REV); \
-  (DST) = rgx_exec1(mm, t.pc + 1, &t.sub); \
-  *mm = mmtmp_; \
-}while(0)
-
-static void
+/* Has a paused thread with t's pc and resume already been pushed this
+ * step? If so, it came from a higher-priority path and t would only
+ * repeat it. Entries from other generations count as empty, so the table
+ * never needs clearing; a nested execution can overwrite some, which only
+ * lets a repeat through.
+ */
+static bool
+pause_seen(struct matcher_s * mm, const rgx_thread * t)
+{
+  index_t pc = (index_t)(t->pc - mm->prog->start);
+  struct pausekey_s * slot;
+  if (mm->pausedgen != mm->generation) {
+    mm->pausedgen = mm->generation;
+    mm->pausedlen = 0;
+  }
+  if (2 * (mm->pausedlen + 1) > mm->pausedcap && !pause_grow(mm)) return false;
+  slot = pause_slot(mm, pc, t->resume);
+  if (slot->gen == mm->generation) return true;
+  slot->gen = mm->generation;
+  slot->pc = pc;
+  slot->resume = t->resume;
+  mm->pausedlen++;
+  return false;
+}
+
+#define RESUME_SOONER(MM,A,B)  ((MM)->reverse ? (A) > (B) : (A) < (B))
+#define RESUME_REACHED(MM,R)   ((MM)->reverse ? (MM)->iter.curp <= (R) : (MM)->iter.curp >= (R))
+
+static bool
+sleepers_push(struct matcher_s * mm, struct sleepers_s * sl, rgx_thread t)
+{
+  if (sl->len >= sl->cap) {
+    size_t cap = sl->cap ? sl->cap * 2 : 16;
+    rgx_thread * threads = MEM_RESIZE(mm->alloc, sl->threads, cap * sizeof(rgx_thread));
+    const UChar ** wake;
+    if (!threads) return false;
+    sl->threads = threads;
+    if (!(wake = MEM_RESIZE(mm->alloc, sl->wake, cap * sizeof(const UChar *)))) return false;
+    sl->wake = wake;
+    BUDGET_ALLOC(mm, (cap - sl->cap) * (sizeof(rgx_thread) + sizeof(const UChar *)), false);
+    sl->cap = cap;
+  }
+  sl->threads[sl->len] = t;
+  sl->wake[sl->len] = (sl->len && !RESUME_SOONER(mm, t.resume, sl->wake[sl->len - 1])) ?
+                      sl->wake[sl->len - 1] : t.resume;
+  sl->len++;
+  return true;
+}
+
+/* Moves the sleepers that resume this step to the head of tlist, to be
+ * run first. If one below the top is due too, they all go, and those
+ * still paused are pushed back as the list is rebuilt.
+ */
+static void
+sleepers_wake(struct matcher_s * mm, struct sleepers_s * sl, rgx_threadlist * tlist)
+{
+  size_t k = sl->len, n;
+  while (k > 0 && RESUME_REACHED(mm, sl->threads[k - 1].resume)) --k;
+  if (k > 0 && RESUME_REACHED(mm, sl->wake[k - 1])) k = 0;
+  n = sl->len - k;
+  if (tlist->len + n > tlist->cap) {
+    size_t cap = tlist->cap;
+    rgx_thread * grown;
+    while (cap < tlist->len + n) cap *= 2;
+    if (!(grown = MEM_RESIZE(mm->alloc, tlist->threads, cap * sizeof(rgx_thread)))) {
+      mm->nomem = true; /* they stay where they are, to be released */
+      return;
+    }
+    BUDGET_ALLOC(mm, (cap - tlist->cap) * sizeof(rgx_thread), false);
+    tlist->threads = grown;
+    tlist->cap = cap;
+  }
+  memmove(tlist->threads + n, tlist->threads, tlist->len * sizeof(rgx_thread));
+  memcpy(tlist->threads, sl->threads + k, n * sizeof(rgx_thread));
+  tlist->len += n;
+  sl->len = k;
+}
+
+/* Each pc is added once per step, but paused threads (OP_BREF, OP_TRIE...)
+ * are carried over between steps, so the list can outgrow prog->len; it
+ * holds at most one of them per pc and resume. Those paused before any
+ * other thread is added go to the sleepers instead.
+ */
+static void
+thread_push(struct matcher_s * mm, rgx_threadlist * tlist, rgx_thread t)
+{
+  struct sleepers_s * sl = tlist->front;
+  if (t.resume && pause_seen(mm, &t)) {
+    STAT(mm, st_->dedups++);
+    sub_dec(mm, t.sub);
+    return;
+  }
+  if (t.resume && sl && !tlist->len) {
+    if (sl->len && sl->threads[sl->len - 1].pc == t.pc &&
+        sl->threads[sl->len - 1].resume == t.resume) { /* carried, so not seen above */
+      STAT(mm, st_->dedups++);
+      sub_dec(mm, t.sub);
+    } else if (!sleepers_push(mm, sl, t)) {
+      mm->nomem = true;
+      sub_dec(mm, t.sub);
+    }
+    return;
+  }
+  if (tlist->len >= tlist->cap) {
+    rgx_thread * grown = MEM_RESIZE(mm->alloc, tlist->threads,
+                                    2 * tlist->cap * sizeof(rgx_thread));
+    if (!grown) { /* the old list is still ours; rgx_exec1 gives up */
+      mm->nomem = true;
+      sub_dec(mm, t.sub);
+      return;
+    }
+    BUDGET_ALLOC(mm, tlist->cap * sizeof(rgx_thread), false);
+    tlist->threads = grown;
+    tlist->cap *= 2;
+  }
+  tlist->threads[tlist->len++] = t;
+  if (t.resume && (!tlist->npaused++ || (mm->reverse ? t.resume > tlist->wake
+                                                      : t.resume < tlist->wake)))
+    tlist->wake = t.resume;
+}
+
+/* When every thread is paused, nothing happens until the nearest one
+ * resumes: skip to the step that reaches it, rather than carrying the
+ * threads over one character at a time.
+ */
+static void
+skip_paused(struct matcher_s * mm, const rgx_threadlist * tlist)
+{
+  const struct sleepers_s * sl = tlist->front;
+  uni_iter it = mm->iter;
+  if (tlist->npaused < tlist->len) return;
+  if (!tlist->npaused) it.curp = sl->wake[sl->len - 1];
+  else if (!sl->len || RESUME_SOONER(mm, tlist->wake, sl->wake[sl->len - 1])) it.curp = tlist->wake;
+  else it.curp = sl->wake[sl->len - 1];
+  if (mm->reverse) uni_iter_next(&it); else uni_iter_prev(&it); /* one short of it */
+  if (mm->reverse ? it.curp < mm->iter.curp : it.curp > mm->iter.curp) {
+    mm->iter.curp = it.curp;
+    mm->peekcls = 0;
+  }
+}
+
+#define MATCH(EX)  do{ if (EX) goto keep_thread; else goto drop_thread; }while(0)
+#define NMATCH(EX) do{ if (EX) goto drop_thread; else goto keep_thread; }while(0)
+#define MATCHJ(EX) do{ if (EX) goto jump_thread; else goto drop_thread; }while(0)
+#undef MORE
+#undef CUR
+#undef NEXT
+#undef PEEK
+#define MORE  (mm->cur != EOF)
+#define CUR   (mm->cur)
+#define NEXT  do{ \
+  mm->cur = mm->reverse ? uni_iter_prev(&mm->iter) : uni_iter_next(&mm->iter); \
+  mm->curcls = mm->peekcls; /* the old PEEK is the new CUR */ \
+  mm->peekcls = 0; \
+}while(0)
+#define PEEK  (mm->reverse ? uni_iter_rpeek(&mm->iter) : uni_iter_peek(&mm->iter))
+#define CURCLS   (mm->curcls  ? mm->curcls  : (mm->curcls  = char_class(CUR)))
+#define PEEKCLS  (mm->peekcls ? mm->peekcls : (mm->peekcls = char_class(PEEK)))
+
+/* Every class of a character, computed once per step however many
+ * threads look at it.
+ */
+static unsigned int
+char_class(UChar32 c)
+{
+  if (c == EOF) return CLS_KNOWN | CLS_EOF;
+  return CLS_KNOWN | uni_class(c);
+}
+
+static bool rgx_exec1(struct matcher_s * mm, rgx_code * pc, rgx_submatch ** sub);
+
+static bool
+match_backref(struct matcher_s * mm, bool quoted, rgx_thread t, const UChar ** resume)
+{
+  const UChar * ref = t.sub->ptrs[t.pc->subidx];
+  const UChar * end = t.sub->ptrs[t.pc->subidx + 1];
+  size_t n;
+  if (!ref || !end) return false; /* failed submatch */
+  n = (size_t)(end - ref);
+  if (mm->reverse) {
+    if ((size_t)(mm->iter.curp - mm->iter.startp) < n) return false;
+    if (quoted ? !uni_quote_equal(mm->iter.curp - n, ref, n)
+               : memcmp(mm->iter.curp - n, ref, n * sizeof(UChar))) return false;
+    if (resume) *resume = mm->iter.curp - n;
+  } else {
+    if ((size_t)(mm->iter.endp - mm->iter.curp) < n) return false;
+    if (quoted ? !uni_quote_equal(mm->iter.curp, ref, n)
+               : memcmp(mm->iter.curp, ref, n * sizeof(UChar))) return false;
+    if (resume) *resume = mm->iter.curp + n;
+  }
+  return true;
+}
+
+/* The body of a peek (see peek_length), one character per opcode, read
+ * going 'rev' from here.
+ */
+static bool
+match_peek(struct matcher_s * mm, const rgx_code * peek, bool rev)
+{
+  uni_iter iter = mm->iter;
+  const rgx_code * pc;
+  UChar32 c;
+  for (pc = peek + 1; pc < peek->addr; ++pc) {
+    c = rev ? uni_iter_prev(&iter) : uni_iter_next(&iter);
+    if (c == EOF) return false;
+    switch (pc->opcode) {
+      case OP_CHAR:  if (c != pc->valc) return false; break;
+      case OP_SET:   if (!uset_contains(pc->cset, c)) return false; break;
+      case OP_CLASS: if (!(char_class(c) & pc->clsmask) != pc->clsneg) return false; break;
+      default: break; /* OP_ANY */
+    }
+  }
+  return true;
+}
+
+/* Find the first word after 'after' that matches here. Every node on the
+ * path is a different length, so no two words can share an end.
+ */
+static index_t
+match_trie(struct matcher_s * mm, const rgx_trie * tr, index_t after, const UChar ** end)
+{
+  uni_iter iter = mm->iter;
+  index_t node = 0;
+  index_t found = -1;
+  UChar32 c;
+  for (;;) {
+    index_t w = tr->nodes[node].word;
+    index_t lo, hi;
+    if (w > after && (found < 0 || w < found)) { found = w; *end = iter.curp; }
+    c = mm->reverse ? uni_iter_prev(&iter) : uni_iter_next(&iter);
+    if (c == EOF) break;
+    lo = tr->nodes[node].edge;
+    hi = lo + tr->nodes[node].nedge - 1;
+    node = -1;
+    while (lo <= hi) {
+      index_t mid = lo + ((hi - lo) / 2);
+      if      (tr->edges[mid].c > c) hi = mid - 1;
+      else if (tr->edges[mid].c < c) lo = mid + 1;
+      else { node = tr->edges[mid].node; break; }
+    }
+    if (node < 0) break;
+  }
+  return found;
+}
+
+/* Where the brace pair starting here ends, or null if it doesn't. Each
+ * close has to match the open it closes, so opens are kept on a stack;
+ * it starts out local and moves to the heap when nesting gets deep.
+ * Every character scanned counts as a step.
+ *
+ * Scanning from one open also finds where every open nested in it ends,
+ * and that every open still on the stack when the scan fails never ends:
+ * a scan from there would see the same characters with the same stack
+ * above it. All of those are kept in a table for as long as the matcher
+ * searches the same input, so {balanced} tried at every position scans
+ * each character about once in all, not once per position.
+ */
+#define RGX_BALANCE_STACK  64
+
+struct balopen_s {
+  UChar32 c;
+  const UChar * at; /* where a {balanced} starting with it starts */
+};
+
+static struct balkey_s *
+balanced_slot(struct matcher_s * mm, const UChar * open, bool reverse)
+{
+  size_t mask = mm->balancedcap - 1;
+  size_t i = (((size_t)(uintptr_t)open >> 1) * 0x9E3779B1u + reverse) & mask;
+  while (mm->balanced[i].open &&
+         (mm->balanced[i].open != open || mm->balanced[i].reverse != reverse)) i = (i + 1) & mask;
+  return &mm->balanced[i];
+}
+
+/* only a cache: if it can't grow, the answer just isn't kept */
+static void
+balanced_put(struct matcher_s * mm, const UChar * open, const UChar * end)
+{
+  struct balkey_s * slot;
+  if (2 * (mm->balancedlen + 1) > mm->balancedcap) {
+    struct balkey_s * old = mm->balanced;
+    size_t oldcap = mm->balancedcap;
+    size_t cap = oldcap ? oldcap * 2 : 64;
+    size_t i;
+    if (!(mm->balanced = MEM_ALLOC(mm->alloc, cap * sizeof(struct balkey_s)))) {
+      mm->balanced = old;
+      return;
+    }
+    BUDGET_ALLOC(mm, cap * sizeof(struct balkey_s), false);
+    memset(mm->balanced, 0, cap * sizeof(struct balkey_s));
+    mm->balancedcap = cap;
+    for (i = 0; i < oldcap; ++i) {
+      if (old[i].open) *balanced_slot(mm, old[i].open, old[i].reverse) = old[i];
+    }
+    if (old) {
+      BUDGET_ALLOC(mm, oldcap * sizeof(struct balkey_s), true);
+      MEM_FREE(mm->alloc, old);
+    }
+  }
+  slot = balanced_slot(mm, open, mm->reverse);
+  if (!slot->open) mm->balancedlen++;
+  slot->open = open;
+  slot->end = end;
+  slot->reverse = mm->reverse;
+}
+
+static const UChar *
+match_balanced(struct matcher_s * mm)
+{
+  struct balopen_s local[RGX_BALANCE_STACK];
+  struct balopen_s * stack = local;
+  size_t cap = RGX_BALANCE_STACK;
+  size_t depth = 0;
+  unsigned int opens = mm->reverse ? CLS_CLOSE : CLS_OPEN;
+  unsigned int closes = mm->reverse ? CLS_OPEN : CLS_CLOSE;
+  uni_iter iter = mm->iter;
+  const UChar * end = NULL;
+  const UChar * at;
+  bool failed = false; /* rather than stopped short */
+  UChar32 c;
+  if (mm->balancedlen) {
+    struct balkey_s * slot = balanced_slot(mm, iter.curp, mm->reverse);
+    if (slot->open) return slot->end;
+  }
+  for (;;) {
+    unsigned int cls;
+    at = iter.curp;
+    if ((c = mm->reverse ? uni_iter_prev(&iter) : uni_iter_next(&iter)) == EOF) {
+      failed = true;
+      break;
+    }
+    cls = uni_class(c);
+    if (mm->budget && !budget_step(mm->budget)) break;
+    if (depth && (cls & closes) && uni_ismatch(stack[depth - 1].c, c)) {
+      --depth;
+      balanced_put(mm, stack[depth].at, iter.curp);
+      if (depth == 0) { end = iter.curp; break; }
+    } else if (cls & opens) {
+      if (depth >= cap) {
+        struct balopen_s * p = MEM_ALLOC(mm->alloc, cap * 2 * sizeof(struct balopen_s));
+        if (!p) { mm->nomem = true; break; }
+        BUDGET_ALLOC(mm, cap * 2 * sizeof(struct balopen_s), false);
+        memcpy(p, stack, depth * sizeof(struct balopen_s));
+        if (stack != local) {
+          BUDGET_ALLOC(mm, cap * sizeof(struct balopen_s), true);
+          MEM_FREE(mm->alloc, stack);
+        }
+        stack = p;
+        cap *= 2;
+      }
+      stack[depth].c = c;
+      stack[depth].at = at;
+      depth++;
+    } else if (!depth || (cls & closes)) {
+      failed = true;
+      break; /* not an open, or closes the wrong one */
+    }
+  }
+  if (failed) while (depth) balanced_put(mm, stack[--depth].at, NULL);
+  if (stack != local) {
+    BUDGET_ALLOC(mm, cap * sizeof(struct balopen_s), true);
+    MEM_FREE(mm->alloc, stack);
+  }
+  return end;
+}
+
+/* KIND is the rgx_exec_stats counter it falls under */
+#define RECURSE(DST,REV,PC,KIND) do{ \
+  struct matcher_s mmtmp_ = *mm; \
+  IF_STATS(uint64_t t0_ = 0;) \
+  mm->depth++; \
+  (DST) = false; \
+  if (!mm->budget || budget_nest(mm->budget, mm->depth)) { \
+    STAT(mm, st_->KIND++; if (mm->depth > st_->max_depth) st_->max_depth = mm->depth; \
+             if (st_->pcs) t0_ = clock_ns()); \
+    PROBE3(nested_start, t.pc, mm->depth, #KIND); \
+    rgx_submatch * in_ = t.sub; \
+    mm->reverse = (REV); \
+    (DST) = rgx_exec1(mm, (PC), &t.sub); \
+    if (DST) sub_dec(mm, in_); /* swapped for the match's */ \
+    PCSTAT(mm, t.pc, ps_->nested_ns += clock_ns() - t0_); \
+    PROBE3(nested_done, t.pc, mm->depth, (DST)); \
+  } \
+  mmtmp_.freesub = mm->freesub; \
+  mmtmp_.nomem = mm->nomem; \
+  mmtmp_.paused = mm->paused; mmtmp_.pausedcap = mm->pausedcap; /* may have grown */ \
+  mmtmp_.balanced = mm->balanced; mmtmp_.balancedcap = mm->balancedcap; \
+  mmtmp_.balancedlen = mm->balancedlen; \
+  *mm = mmtmp_; \
+}while(0)
+
+static void
 addthread(struct matcher_s * mm, rgx_threadlist * tlist, rgx_thread t)
 {
+  unsigned int * mark = &mm->marks[t.pc - mm->prog->start];
   bool b;
-  UChar32 c;
-  if (t.pc->generation == mm->generation) goto drop_thread; /* already in list */
-  t.pc->generation = mm->generation;
+  STAT(mm, st_->addthreads++);
+  if (*mark == mm->generation) goto drop_thread; /* already in list */
+  *mark = mm->generation;
+  PCSTAT(mm, t.pc, ps_->added++);
 
   switch (t.pc->opcode) {
     jump_thread:
@@ -1435,34 +3446,30 @@ addthread(struct matcher_s * mm, rgx_threadlist * tlist, rgx_thread t)
       addthread(mm, tlist, thread_new(t.pc + 1, sub_update(mm, t.sub, (size_t)t.pc->subidx)));
       break;
     }
-    case OP_BOL:   MATCH(!MORE || uset_contains(ucat_vspace, CUR));
-    case OP_NBOL: NMATCH(!MORE || uset_contains(ucat_vspace, CUR));
-    case OP_EOL:   MATCH((c = PEEK) == EOF || uset_contains(ucat_vspace, c));
-    case OP_NEOL: NMATCH((c = PEEK) == EOF || uset_contains(ucat_vspace, c));
+    case OP_BOL:   MATCH(CURCLS & (CLS_EOF | CLS_VSPACE));
+    case OP_NBOL: NMATCH(CURCLS & (CLS_EOF | CLS_VSPACE));
+    case OP_EOL:   MATCH(PEEKCLS & (CLS_EOF | CLS_VSPACE));
+    case OP_NEOL: NMATCH(PEEKCLS & (CLS_EOF | CLS_VSPACE));
     case OP_BOT:   MATCH(!MORE);
     case OP_NBOT: NMATCH(!MORE);
-    case OP_EOT:   MATCH(PEEK == EOF);
-    case OP_NEOT: NMATCH(PEEK == EOF);
-    case OP_WBND: {
-      bool iswA = MORE && uset_contains(ucat_word, CUR);
-      bool iswB = (c = PEEK) != EOF && uset_contains(ucat_word, c);
-      MATCH(iswA != iswB);
-    }
-    case OP_NWBND: {
-      bool iswA = MORE && uset_contains(ucat_word, CUR);
-      bool iswB = (c = PEEK) != EOF && uset_contains(ucat_word, c);
-      NMATCH(iswA != iswB);
-    }
-    case OP_LOOK:   RECURSE(b,  mm->reverse); MATCHJ( b);
-    case OP_NLOOK:  RECURSE(b,  mm->reverse); MATCHJ(!b);
-    case OP_LOOKR:  RECURSE(b, !mm->reverse); MATCHJ( b);
-    case OP_NLOOKR: RECURSE(b, !mm->reverse); MATCHJ(!b);
+    case OP_EOT:   MATCH(PEEKCLS & CLS_EOF);
+    case OP_NEOT: NMATCH(PEEKCLS & CLS_EOF);
+    case OP_WBND:  MATCH((CURCLS ^ PEEKCLS) & CLS_WORD);
+    case OP_NWBND: NMATCH((CURCLS ^ PEEKCLS) & CLS_WORD);
+    case OP_LOOK:   RECURSE(b,  mm->reverse, t.pc + 1, looks); MATCHJ( b);
+    case OP_NLOOK:  RECURSE(b,  mm->reverse, t.pc + 1, looks); MATCHJ(!b);
+    case OP_LOOKR:  RECURSE(b, !mm->reverse, t.pc + 1, looks); MATCHJ( b);
+    case OP_NLOOKR: RECURSE(b, !mm->reverse, t.pc + 1, looks); MATCHJ(!b);
+    case OP_PEEK:   STAT(mm, st_->peeks++); MATCHJ( match_peek(mm, t.pc,  mm->reverse));
+    case OP_NPEEK:  STAT(mm, st_->peeks++); MATCHJ(!match_peek(mm, t.pc,  mm->reverse));
+    case OP_PEEKR:  STAT(mm, st_->peeks++); MATCHJ( match_peek(mm, t.pc, !mm->reverse));
+    case OP_NPEEKR: STAT(mm, st_->peeks++); MATCHJ(!match_peek(mm, t.pc, !mm->reverse));
 
     case OP_BREF: { /* handled here because we need curp to be useful */
       const UChar * resume = NULL;
       b = match_backref(mm, false, t, &resume);
       if (!b) goto drop_thread;
-      tlist->threads[tlist->len++] = thread_paused(t.pc, resume, t.sub);
+      thread_push(mm, tlist, thread_paused(t.pc, resume, t.sub));
       break;
     }
     case OP_NBREF: { /* zero-width assertion; matches only if backref doesn't */
@@ -1473,7 +3480,7 @@ addthread(struct matcher_s * mm, rgx_threadlist * tlist, rgx_thread t)
       const UChar * resume = NULL;
       b = match_backref(mm, true, t, &resume);
       if (!b) goto drop_thread;
-      tlist->threads[tlist->len++] = thread_paused(t.pc, resume, t.sub);
+      thread_push(mm, tlist, thread_paused(t.pc, resume, t.sub));
       break;
     }
     case OP_NQREF: {
@@ -1483,54 +3490,48 @@ addthread(struct matcher_s * mm, rgx_threadlist * tlist, rgx_thread t)
     case OP_PROC: {
       const UChar * resume = NULL;
       UChar * sav[2] = { t.sub->ptrs[0], t.sub->ptrs[1] };
-      rgx_submatch * freetmp = mm->freesub;
-      b = rgx_exec1(mm, t.pc->addr, &t.sub);
+      RECURSE(b, mm->reverse, t.pc->addr, procs);
       if (b) resume = mm->reverse ? t.sub->ptrs[0] : t.sub->ptrs[1];
-      {
-        struct matcher_s mmtmp = *mm;
-        unsigned int gentmp = mm->generation;
-        *mm = mmtmp;
-        mm->generation = gentmp;
-        mm->freesub = freetmp;
-      }
       t.sub->ptrs[0] = sav[0]; t.sub->ptrs[1] = sav[1];
       if (!b) goto drop_thread;
-      tlist->threads[tlist->len++] = thread_paused(t.pc, resume, t.sub);
+      thread_push(mm, tlist, thread_paused(t.pc, resume, t.sub));
       break;
     }
     case OP_NPROC: { /* zero-width assertion; matches only if proc doesn't */
       UChar * sav[2] = { t.sub->ptrs[0], t.sub->ptrs[1] };
-      struct matcher_s mmtmp = *mm;
-      b = rgx_exec1(mm, t.pc->addr, &t.sub);
-      {
-        struct matcher_s mmtmp = *mm;
-        unsigned int gentmp = mm->generation;
-        *mm = mmtmp;
-        mm->generation = gentmp;
-        mm->freesub = freetmp;
-      }
+      RECURSE(b, mm->reverse, t.pc->addr, procs);
       t.sub->ptrs[0] = sav[0]; t.sub->ptrs[1] = sav[1];
       MATCH(!b);
     }
 
     case OP_COND: {
       UChar * sav[2] = { t.sub->ptrs[0], t.sub->ptrs[1] };
-      struct matcher_s mmtmp = *mm;
-      b = rgx_exec1(mm, t.pc->addr, &t.sub);
-      {
-        struct matcher_s mmtmp = *mm;
-        unsigned int gentmp = mm->generation;
-        *mm = mmtmp;
-        mm->generation = gentmp;
-        mm->freesub = freetmp;
-      }
+      RECURSE(b, mm->reverse, t.pc->addr, procs);
       t.sub->ptrs[0] = sav[0]; t.sub->ptrs[1] = sav[1];
       addthread(mm, tlist, thread_new(t.pc + (b ? 2 : 1), t.sub));
       break;
     }
 
+    case OP_BALANCED: {
+      const UChar * resume = match_balanced(mm);
+      if (!resume) goto drop_thread;
+      thread_push(mm, tlist, thread_paused(t.pc, resume, t.sub));
+      break;
+    }
+
+    case OP_TRIE: { /* one paused thread per word end, in word order */
+      const UChar * resume = NULL;
+      index_t w = -1;
+      while ((w = match_trie(mm, t.pc->ctrie, w, &resume)) >= 0) {
+        if (resume == mm->iter.curp) addthread(mm, tlist, thread_new(t.pc + 1, sub_inc(mm, t.sub)));
+        else thread_push(mm, tlist, thread_paused(t.pc, resume, sub_inc(mm, t.sub)));
+      }
+      goto drop_thread;
+    }
+
     drop_thread:
     case OP_NONE: {
+      PCSTAT(mm, t.pc, ps_->dropped++);
       sub_dec(mm, t.sub);
       break;
     }
@@ -1539,7 +3540,7 @@ addthread(struct matcher_s * mm, rgx_threadlist * tlist, rgx_thread t)
       break;
     }
     default: {
-      tlist->threads[tlist->len++] = t;
+      thread_push(mm, tlist, t);
       break;
     }
   }
@@ -1552,18 +3553,43 @@ rgx_exec1(struct matcher_s * mm, rgx_code * pc, rgx_submatch ** subp)
   rgx_threadlist tln;
   rgx_threadlist * tlcurr = &tlc;
   rgx_threadlist * tlnext = &tln;
+  struct sleepers_s front = { 0, 0, NULL, NULL };
   rgx_submatch * curmatches = NULL;
   rgx_submatch * sub;
   size_t i;
 
-  tlcurr->threads = malloc(mm->prog->len * sizeof(rgx_thread)); tlcurr->len = 0;
-  tlnext->threads = malloc(mm->prog->len * sizeof(rgx_thread)); tlnext->len = 0;
+  tlcurr->front = tlnext->front = &front;
+  tlcurr->cap = tlnext->cap = mm->prog->len;
+  tlcurr->threads = MEM_ALLOC(mm->alloc, tlcurr->cap * sizeof(rgx_thread)); tlcurr->len = 0;
+  tlnext->threads = MEM_ALLOC(mm->alloc, tlnext->cap * sizeof(rgx_thread)); tlnext->len = 0;
+  if (!tlcurr->threads || !tlnext->threads) {
+    if (tlcurr->threads) MEM_FREE(mm->alloc, tlcurr->threads);
+    if (tlnext->threads) MEM_FREE(mm->alloc, tlnext->threads);
+    mm->nomem = true;
+    return false;
+  }
+  tlcurr->npaused = tlnext->npaused = 0;
+  BUDGET_ALLOC(mm, 2 * mm->prog->len * sizeof(rgx_thread), false);
+
+  /* CUR is the character behind us, whichever way we're going */
+  mm->cur = mm->reverse ? uni_iter_peek(&mm->iter) : uni_iter_rpeek(&mm->iter);
+  mm->curcls = 0;
+  mm->peekcls = 0;
 
+  mm->generation = ++*mm->lastgen;
   addthread(mm, tlcurr, thread_new(pc, sub_inc(mm, *subp)));
 
-  while (tlcurr->len > 0) {
+  while (tlcurr->len > 0 || front.len > 0) {
+    if (mm->budget && !budget_step(mm->budget)) break;
+    if (mm->nomem) break;
+    skip_paused(mm, tlcurr);
     NEXT;
-    mm->generation++;
+    mm->generation = ++*mm->lastgen;
+    STAT(mm, if (tlcurr->len + front.len > st_->peak_threads)
+               st_->peak_threads = tlcurr->len + front.len);
+    if (front.len && RESUME_REACHED(mm, front.wake[front.len - 1]))
+      sleepers_wake(mm, &front, tlcurr);
+    STAT(mm, st_->steps++; st_->sum_threads += tlcurr->len);
     for (i = 0; i < tlcurr->len; ++i) {
       pc = tlcurr->threads[i].pc;
       sub = tlcurr->threads[i].sub;
@@ -1575,23 +3601,32 @@ rgx_exec1(struct matcher_s * mm, rgx_code * pc, rgx_submatch ** subp)
           break;
         }
         case OP_SET:  MATCH(MORE && uset_contains(pc->cset, CUR));
+        case OP_CLASS: MATCH(MORE && !(CURCLS & pc->clsmask) == pc->clsneg);
         case OP_CHAR: MATCH(MORE && CUR == pc->valc);
-        case OP_ANY:  MATCH(MORE);
+        case OP_ANY:  MATCH(MORE && (pc != PREFIX_ANY(mm->prog) || !mm->startlimit ||
+                                     mm->iter.curp < mm->startlimit));
 
         case OP_BREF: /* if seen here, match already happened */
         case OP_QREF:
-        case OP_PROC: {
+        case OP_PROC:
+        case OP_TRIE:
+        case OP_BALANCED: {
           const UChar * resume = tlcurr->threads[i].resume;
-          if (mm->reverse ? mm->iter.curp <= resume : mm->iter.curp >= resume) goto keep_thread;
-          tlnext->threads[tlnext->len++] = tlcurr->threads[i];
+          if (mm->reverse ? mm->iter.curp <= resume : mm->iter.curp >= resume) {
+            STAT(mm, st_->resumes++);
+            goto keep_thread;
+          }
+          thread_push(mm, tlnext, tlcurr->threads[i]);
           break;
         }
 
         keep_thread: {
+          PCSTAT(mm, pc, ps_->consumed++);
           addthread(mm, tlnext, thread_new(pc + 1, sub));
           break;
         }
         drop_thread: {
+          PCSTAT(mm, pc, ps_->dropped++);
           sub_dec(mm, sub);
           break;
         }
@@ -1599,53 +3634,672 @@ rgx_exec1(struct matcher_s * mm, rgx_code * pc, rgx_submatch ** subp)
       }
     }
     { rgx_threadlist * tmp = tlcurr; tlcurr = tlnext; tlnext = tmp; }
-    tlnext->len = 0;
+    tlnext->len = tlnext->npaused = 0;
     if (!MORE) break;
   }
-  free(tlcurr->threads);
-  free(tlnext->threads);
+  for (i = 0; i < tlcurr->len; ++i) sub_dec(mm, tlcurr->threads[i].sub); /* still paused */
+  for (i = 0; i < front.len; ++i) sub_dec(mm, front.threads[i].sub);
+  BUDGET_ALLOC(mm, front.cap * (sizeof(rgx_thread) + sizeof(const UChar *)), true);
+  if (front.threads) MEM_FREE(mm->alloc, front.threads);
+  if (front.wake) MEM_FREE(mm->alloc, front.wake);
+  BUDGET_ALLOC(mm, (tlcurr->cap + tlnext->cap) * sizeof(rgx_thread), true);
+  MEM_FREE(mm->alloc, tlcurr->threads);
+  MEM_FREE(mm->alloc, tlnext->threads);
+  if (curmatches && (mm->nomem || (mm->budget && mm->budget->stop))) { /* may have been cut short */
+    sub_dec(mm, curmatches);
+    curmatches = NULL;
+  }
   if (curmatches) { *subp = curmatches; return true; }
   return false;
 }
 
-bool
-rgx_exec(rgx_prog * prog, const UChar * input, size_t inputlen, UChar ** subp, size_t nsubp)
+/* A matcher can be reused for any number of inputs on one thread; it keeps
+ * its marks and freed submatches between them.
+ */
+static bool
+matcher_open(struct matcher_s * mm, rgx_prog * prog, unsigned int * lastgen)
 {
-  struct matcher_s matcher;
-  struct matcher_s * mm = &matcher;
+  mm->prog = prog;
+  mm->alloc = &prog->alloc;
+  mm->generation = 0;
+  mm->lastgen = lastgen;
+  *lastgen = 0;
+  mm->nsubs = prog->nameslen * 2;
+  mm->freesub = NULL;
+  mm->startlimit = NULL;
+  mm->budget = NULL;
+  mm->depth = 0;
+  mm->nomem = false;
+  mm->paused = NULL;
+  mm->pausedcap = mm->pausedlen = 0;
+  mm->pausedgen = 0;
+  mm->balanced = NULL;
+  mm->balancedcap = mm->balancedlen = 0;
+  memset(&mm->balancedin, 0, sizeof(mm->balancedin));
+#ifdef RGX_STATS
+  mm->stats = NULL;
+#endif
+  mm->marks = MEM_ALLOC(mm->alloc, (prog->len ? prog->len : 1) * sizeof(unsigned int));
+  if (mm->marks) memset(mm->marks, 0, (prog->len ? prog->len : 1) * sizeof(unsigned int));
+  return mm->marks != NULL;
+}
+
+static void
+matcher_close(struct matcher_s * mm)
+{
+  while (mm->freesub) {
+    rgx_submatch * s = mm->freesub;
+    mm->freesub = (rgx_submatch*)s->ptrs[0];
+    MEM_FREE(mm->alloc, s);
+  }
+  MEM_FREE(mm->alloc, mm->marks);
+  if (mm->paused) MEM_FREE(mm->alloc, mm->paused);
+  if (mm->balanced) MEM_FREE(mm->alloc, mm->balanced);
+}
+
+/* search input from input + from; what's before is still seen by
+ * look-behind and assertions */
+static bool
+matcher_exec(struct matcher_s * mm, const UChar * input, size_t inputlen, size_t from,
+             UChar ** subp, size_t nsubp)
+{
+  rgx_submatch * first;
   rgx_submatch * sub;
-  size_t i;
+  size_t n = nsubp < mm->nsubs ? nsubp : mm->nsubs;
+  bool m;
 
+  if (*mm->lastgen > UINT_MAX / 2) { /* don't let the marks wrap around */
+    PROBE1(marks_reset, mm->prog->len);
+    memset(mm->marks, 0, mm->prog->len * sizeof(unsigned int));
+    if (mm->paused) memset(mm->paused, 0, mm->pausedcap * sizeof(struct pausekey_s));
+    mm->pausedgen = 0;
+    *mm->lastgen = 0;
+  }
+  PROBE2(exec_start, input, inputlen);
   uni_iter_init(&mm->iter, input, inputlen);
-  mm->prog = prog;
-  mm->generation = 1;
+  if (mm->balancedlen && (mm->balancedin.startp != mm->iter.startp ||
+                          mm->balancedin.endp != mm->iter.endp)) {
+    memset(mm->balanced, 0, mm->balancedcap * sizeof(struct balkey_s));
+    mm->balancedlen = 0;
+  }
+  mm->balancedin = mm->iter;
+  mm->iter.curp += from;
   mm->cur = EOF;
   mm->reverse = false;
-  mm->nsubs = nsubp;
-  mm->freesub = NULL;
+  mm->nomem = false;
 
-  for (i = 0; i < prog->len; ++i) prog->start[i].generation = 0;
-  sub = sub_new(mm);
+  if (!(first = sub = sub_new(mm))) return false;
   memset(sub->ptrs, 0, mm->nsubs * sizeof(UChar*));
 
-  if (rgx_exec1(mm, prog->start, &sub)) {
-    memcpy(subp, sub->ptrs, mm->nsubs * sizeof(UChar*));
+  m = rgx_exec1(mm, mm->prog->start, &sub);
+  PROBE3(exec_done, inputlen, m, mm->iter.curp - input);
+  if (m) {
+    if (subp) {
+      memcpy(subp, sub->ptrs, n * sizeof(UChar*));
+      memset(subp + n, 0, (nsubp - n) * sizeof(UChar*));
+    }
     sub_dec(mm, sub);
-    return true;
   }
-  return false;
+  sub_dec(mm, first);
+  return m;
+}
+
+/* Telemetry counts what callers asked for: one execution per rgx_exec*
+ * call (per input, for rgx_exec_batch), with its whole input counted once,
+ * however many searches it takes inside. tele_start returns the clock if
+ * this one is timed, else 0.
+ */
+static uint64_t
+tele_start(rgx_prog * prog, struct telemetry_s ** telep)
+{
+  struct telemetry_s * tele = __atomic_load_n(&prog->tele, __ATOMIC_ACQUIRE);
+  *telep = tele;
+  if (tele && __atomic_fetch_add(&tele->execs, 1, __ATOMIC_RELAXED) % tele->sample == 0)
+    return clock_ns();
+  return 0;
+}
+
+static void
+tele_done(struct telemetry_s * tele, uint64_t start, bool matched, size_t inputlen)
+{
+  if (!tele) return;
+  if (matched) __atomic_fetch_add(&tele->matches, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&tele->bytes, inputlen * sizeof(UChar), __ATOMIC_RELAXED);
+  if (start) {
+    uint64_t ns = clock_ns() - start;
+    uint64_t worst = __atomic_load_n(&tele->worst_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tele->timed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tele->ns, ns, __ATOMIC_RELAXED);
+    while (ns > worst && !__atomic_compare_exchange_n(&tele->worst_ns, &worst, ns, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+}
+
+bool
+rgx_exec(rgx_prog * prog, const UChar * input, size_t inputlen, UChar ** subp, size_t nsubp)
+{
+  struct matcher_s matcher;
+  struct telemetry_s * tele;
+  uint64_t start;
+  unsigned int lastgen;
+  bool m;
+
+  if (!matcher_open(&matcher, prog, &lastgen)) return false;
+  start = tele_start(prog, &tele);
+  m = matcher_exec(&matcher, input, inputlen, 0, subp, nsubp);
+  matcher_close(&matcher);
+  tele_done(tele, start, m, inputlen);
+  return m;
+}
+
+bool
+rgx_exec_with_stats(rgx_prog * prog, const UChar * input, size_t inputlen,
+                    UChar ** subp, size_t nsubp, rgx_exec_stats * stats)
+{
+  struct matcher_s matcher;
+  struct telemetry_s * tele;
+  uint64_t start;
+  unsigned int lastgen;
+  bool m;
+
+  rgx_pc_stats * pcs = stats->pcs;
+  memset(stats, 0, sizeof(*stats));
+  stats->pcs = pcs;
+  if (!matcher_open(&matcher, prog, &lastgen)) return false;
+  start = tele_start(prog, &tele);
+#ifdef RGX_STATS
+  matcher.stats = stats;
+#endif
+  m = matcher_exec(&matcher, input, inputlen, 0, subp, nsubp);
+  matcher_close(&matcher);
+  tele_done(tele, start, m, inputlen);
+  return m;
+}
+
+rgx_result
+rgx_exec_limited(rgx_prog * prog, const UChar * input, size_t inputlen,
+                 UChar ** subp, size_t nsubp, const rgx_limits * limits)
+{
+  struct matcher_s matcher;
+  struct budget_s budget;
+  struct telemetry_s * tele;
+  uint64_t start;
+  unsigned int lastgen;
+  bool m;
+
+  memset(&budget, 0, sizeof(budget));
+  budget_start(&budget, limits);
+  if (!matcher_open(&matcher, prog, &lastgen)) return RGX_OUT_OF_MEMORY;
+  start = tele_start(prog, &tele);
+  matcher.budget = &budget;
+  m = matcher_exec(&matcher, input, inputlen, 0, subp, nsubp);
+  matcher_close(&matcher);
+  tele_done(tele, start, m && !budget.stop, inputlen);
+  if (matcher.nomem) return RGX_OUT_OF_MEMORY;
+  if (budget.stop) return budget.stop;
+  return m ? RGX_MATCH : RGX_NO_MATCH;
 }
 
 /* ********************************************************************** */
 /* ********************************************************************** */
 
-#include <time.h>
+/* Matching many inputs against one program.
+ *
+ * Workers claim chunks of inputs from a shared cursor, each with its own
+ * matcher. A chunk is sized to about RGX_BATCH_BYTES of input, so short
+ * records don't all fight over the cursor, but kept small enough that
+ * every worker gets several chunks and a few long inputs can't leave the
+ * other workers idle.
+ */
+
+#define RGX_BATCH_BYTES   (64*1024)
+#define RGX_BATCH_SPREAD  (8) /* at least this many chunks per worker */
+
+struct batch_s {
+  rgx_prog * prog;
+  const UChar * const * inputs;
+  const size_t * lens;
+  size_t n;
+  bool * matched;
+  rgx_result * outcomes;
+  UChar ** results;
+  size_t nsubp;
+  const rgx_limits * limits; /* per input; null if unlimited */
+  size_t chunk;
+  size_t next;     /* first unclaimed input; atomic */
+  size_t nmatched; /* atomic */
+  bool nomem;      /* a worker ran out of memory; atomic */
+};
+
+static void *
+batch_worker(void * arg)
+{
+  struct batch_s * b = arg;
+  struct matcher_s matcher;
+  struct budget_s budget;
+  unsigned int lastgen;
+  size_t nmatched = 0;
+  size_t i, end;
+
+  if (!matcher_open(&matcher, b->prog, &lastgen)) {
+    __atomic_store_n(&b->nomem, true, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  memset(&budget, 0, sizeof(budget));
+  if (b->limits) matcher.budget = &budget;
+  for (;;) {
+    i = __atomic_fetch_add(&b->next, b->chunk, __ATOMIC_RELAXED);
+    if (i >= b->n) break;
+    end = (b->n - i < b->chunk) ? b->n : i + b->chunk;
+    for (; i < end; ++i) {
+      UChar ** subp = b->results ? b->results + i * b->nsubp : NULL;
+      struct telemetry_s * tele;
+      uint64_t start = tele_start(b->prog, &tele);
+      bool m;
+      if (b->limits) budget_start(&budget, b->limits);
+      m = matcher_exec(&matcher, b->inputs[i], b->lens[i], 0, subp, b->nsubp) && !budget.stop;
+      tele_done(tele, start, m, b->lens[i]);
+      if (matcher.nomem) {
+        if (b->outcomes) b->outcomes[i] = RGX_OUT_OF_MEMORY;
+        __atomic_store_n(&b->nomem, true, __ATOMIC_RELAXED);
+        goto done;
+      }
+      if (!m && subp) memset(subp, 0, b->nsubp * sizeof(UChar*));
+      if (b->matched) b->matched[i] = m;
+      if (b->outcomes) b->outcomes[i] = budget.stop ? budget.stop : m ? RGX_MATCH : RGX_NO_MATCH;
+      nmatched += m;
+    }
+  }
+done:
+  matcher_close(&matcher);
+  __atomic_fetch_add(&b->nmatched, nmatched, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static size_t
+exec_batch(rgx_prog * prog, const UChar * const * inputs, const size_t * lens, size_t n,
+           bool * matched, rgx_result * outcomes, UChar ** results, size_t nsubp,
+           unsigned int nthreads, const rgx_limits * limits)
+{
+  struct batch_s batch;
+  pthread_t * workers = NULL;
+  size_t total = 0;
+  size_t chunk;
+  unsigned int i, started = 0;
+
+  if (nthreads == 0) {
+    long np = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = np > 0 ? (unsigned int)np : 1;
+  }
+  if (nthreads > n) nthreads = n ? (unsigned int)n : 1;
+
+  for (i = 0; i < n; ++i) total += lens[i];
+  chunk = n ? RGX_BATCH_BYTES / (total / n + 1) : 1;
+  if (chunk > n / (nthreads * RGX_BATCH_SPREAD)) chunk = n / (nthreads * RGX_BATCH_SPREAD);
+  if (chunk < 1) chunk = 1;
+
+  batch.prog = prog;
+  batch.inputs = inputs;
+  batch.lens = lens;
+  batch.n = n;
+  batch.matched = matched;
+  batch.outcomes = outcomes;
+  batch.results = results;
+  batch.nsubp = nsubp;
+  batch.limits = limits;
+  batch.chunk = chunk;
+  batch.next = 0;
+  batch.nmatched = 0;
+  batch.nomem = false;
+
+  /* this thread is one of the workers */
+  if (nthreads > 1) workers = MEM_ALLOC(&prog->alloc, (nthreads - 1) * sizeof(pthread_t));
+  if (workers) {
+    for (; started < nthreads - 1; ++started) {
+      if (pthread_create(&workers[started], NULL, batch_worker, &batch)) break;
+    }
+  }
+  batch_worker(&batch);
+  for (i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+  if (workers) MEM_FREE(&prog->alloc, workers);
+  return batch.nomem ? RGX_EXEC_FAILED : batch.nmatched;
+}
+
+/* Match prog against inputs[0..n) on up to nthreads threads (0 for one per
+ * processor). matched[i] gets whether input i matched, and results gets
+ * nsubp pointers per input as rgx_exec would write them, nulls if it
+ * didn't match; either may be null. Returns the number of matches, or
+ * RGX_EXEC_FAILED if memory ran out before every input was searched.
+ */
+size_t
+rgx_exec_batch(rgx_prog * prog, const UChar * const * inputs, const size_t * lens,
+               size_t n, bool * matched, UChar ** results, size_t nsubp,
+               unsigned int nthreads)
+{
+  return exec_batch(prog, inputs, lens, n, matched, NULL, results, nsubp, nthreads, NULL);
+}
+
+/* rgx_exec_batch with each input searched as by rgx_exec_limited: outcomes[i]
+ * (if not null) gets what rgx_exec_limited would have returned for it, and
+ * an input that passed a limit counts as not matched.
+ */
+size_t
+rgx_exec_batch_limited(rgx_prog * prog, const UChar * const * inputs, const size_t * lens,
+                       size_t n, rgx_result * outcomes, UChar ** results, size_t nsubp,
+                       unsigned int nthreads, const rgx_limits * limits)
+{
+  return exec_batch(prog, inputs, lens, n, NULL, outcomes, results, nsubp, nthreads, limits);
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+/* Finding every match in one large input, in parallel.
+ *
+ * Matches are found one after another, each search starting where the
+ * last match ended (one character later if it was empty). The input is
+ * cut into chunks, and each chunk is searched speculatively, as if no
+ * match had run into it, with new matches only allowed to start inside
+ * it. Once the previous chunks are done, the real starting point in the
+ * chunk is known and the results are stitched together:
+ *
+ *   A search finds the leftmost match, so searching from any point at or
+ *   after a speculative search's origin, and not after the match it found,
+ *   finds the same match. If the real starting point falls inside a
+ *   speculative match instead, the chunk is searched again from there
+ *   until a match lines up with a speculative one.
+ *
+ * That only holds if a search's result depends on nothing but where it
+ * starts, so programs with back-references are searched sequentially.
+ */
+
+#define RGX_SCAN_CHUNK  (16*1024) /* smallest chunk, in code units */
+
+struct span_s {
+  size_t origin; /* where the search that found it started */
+  size_t start;
+  size_t end;
+};
+
+struct spanlist_s {
+  size_t len;
+  size_t cap;
+  struct span_s * buf;
+};
+
+struct scan_s {
+  rgx_prog * prog;
+  const UChar * input;
+  size_t inputlen;
+  size_t * bounds;        /* chunk i is [bounds[i], bounds[i + 1]) */
+  struct spanlist_s * spans;
+  size_t nchunks;
+  const struct budget_s * budget; /* each worker's to start from; null if unlimited */
+  size_t next;            /* first unclaimed chunk; atomic */
+  bool nomem;             /* a worker ran out of memory; atomic */
+  rgx_result stop;        /* the limit a worker passed, if one did; atomic */
+};
+
+static bool
+span_push(const rgx_allocator * alloc, struct spanlist_s * l, size_t origin, size_t start,
+          size_t end)
+{
+  if (l->len >= l->cap) {
+    size_t cap = l->cap ? l->cap * 2 : 16;
+    struct span_s * buf = MEM_RESIZE(alloc, l->buf, cap * sizeof(struct span_s));
+    if (!buf) return false; /* l->buf is still there to release */
+    l->buf = buf;
+    l->cap = cap;
+  }
+  l->buf[l->len].origin = origin;
+  l->buf[l->len].start = start;
+  l->buf[l->len].end = end;
+  l->len++;
+  return true;
+}
+
+/* where the search after a match starts; past inputlen if there's none */
+static size_t
+span_next(const struct scan_s * sc, size_t start, size_t end)
+{
+  if (end != start) return end;
+  if (end >= sc->inputlen) return sc->inputlen + 1;
+  if (U16_IS_LEAD(sc->input[end]) && end + 1 < sc->inputlen &&
+      U16_IS_TRAIL(sc->input[end + 1])) return end + 2;
+  return end + 1;
+}
+
+/* the next match starting in [from, limit) */
+static bool
+scan_search(struct matcher_s * mm, const struct scan_s * sc, size_t from, size_t limit,
+            size_t * start, size_t * end)
+{
+  UChar * subs[2];
+  mm->startlimit = sc->input + limit;
+  if (from >= limit || !matcher_exec(mm, sc->input, sc->inputlen, from, subs, 2)) return false;
+  *start = (size_t)(subs[0] - sc->input);
+  *end = (size_t)(subs[1] - sc->input);
+  return true;
+}
+
+static void *
+scan_worker(void * arg)
+{
+  struct scan_s * sc = arg;
+  struct matcher_s matcher;
+  struct budget_s budget;
+  unsigned int lastgen;
+  size_t k, from, start, end;
+
+  if (!matcher_open(&matcher, sc->prog, &lastgen)) {
+    __atomic_store_n(&sc->nomem, true, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  if (sc->budget) {
+    budget = *sc->budget;
+    matcher.budget = &budget;
+  }
+  while (!__atomic_load_n(&sc->stop, __ATOMIC_RELAXED) &&
+         (k = __atomic_fetch_add(&sc->next, 1, __ATOMIC_RELAXED)) < sc->nchunks) {
+    from = sc->bounds[k];
+    while (scan_search(&matcher, sc, from, sc->bounds[k + 1], &start, &end)) {
+      if (!span_push(&sc->prog->alloc, &sc->spans[k], from, start, end)) {
+        matcher.nomem = true;
+        break;
+      }
+      from = span_next(sc, start, end);
+    }
+    if (matcher.nomem) { /* the chunk's list is short; nothing to stitch with */
+      __atomic_store_n(&sc->nomem, true, __ATOMIC_RELAXED);
+      break;
+    }
+    if (matcher.budget && budget.stop) { /* so is this one; the others stop too */
+      __atomic_store_n(&sc->stop, budget.stop, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  matcher_close(&matcher);
+  return NULL;
+}
+
+/* no back-references, so a search only depends on where it starts */
+static bool
+prog_speculative(rgx_prog * prog)
+{
+  size_t i;
+  for (i = 0; i < prog->len; ++i) {
+    switch (prog->start[i].opcode) {
+      case OP_BREF: case OP_NBREF: case OP_QREF: case OP_NQREF: return false;
+      default: break;
+    }
+  }
+  return true;
+}
+
+static size_t
+exec_all(rgx_prog * prog, const UChar * input, size_t inputlen, UChar ** spans,
+         size_t maxspans, unsigned int nthreads, const rgx_limits * limits,
+         rgx_result * outcome)
+{
+  struct scan_s scan;
+  struct matcher_s matcher;
+  struct budget_s budget;
+  struct telemetry_s * tele;
+  uint64_t begin = tele_start(prog, &tele);
+  unsigned int lastgen;
+  pthread_t * workers = NULL;
+  size_t count = 0;
+  size_t e = 0; /* where the next real search starts */
+  size_t chunk, k, j, start, end;
+  unsigned int i, started = 0;
+
+  if (nthreads == 0) {
+    long np = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = np > 0 ? (unsigned int)np : 1;
+  }
+  chunk = inputlen / (nthreads * 4) + 1;
+  if (chunk < RGX_SCAN_CHUNK) chunk = RGX_SCAN_CHUNK;
+  if (nthreads == 1 || !prog_speculative(prog)) chunk = inputlen + 1;
+  /* steps and scratch are for the whole call, so only one thread can count them */
+  if (limits && (limits->steps || limits->scratch)) chunk = inputlen + 1;
+  if (limits) {
+    memset(&budget, 0, sizeof(budget));
+    budget_start(&budget, limits);
+  }
+
+  scan.prog = prog;
+  scan.input = input;
+  scan.inputlen = inputlen;
+  scan.nchunks = inputlen / chunk + 1;
+  scan.budget = limits ? &budget : NULL;
+  scan.next = 0;
+  scan.nomem = false;
+  scan.stop = RGX_NO_MATCH;
+  scan.bounds = MEM_ALLOC(&prog->alloc, (scan.nchunks + 1) * sizeof(size_t));
+  scan.spans = MEM_ALLOC(&prog->alloc, scan.nchunks * sizeof(struct spanlist_s));
+  if (!scan.bounds || !scan.spans) {
+    if (scan.bounds) MEM_FREE(&prog->alloc, scan.bounds);
+    if (scan.spans) MEM_FREE(&prog->alloc, scan.spans);
+    tele_done(tele, begin, false, inputlen);
+    *outcome = RGX_OUT_OF_MEMORY;
+    return RGX_EXEC_FAILED;
+  }
+  memset(scan.spans, 0, scan.nchunks * sizeof(struct spanlist_s));
+  for (k = 0; k < scan.nchunks; ++k) {
+    size_t b = k * chunk;
+    if (b > 0 && b < inputlen && U16_IS_TRAIL(input[b]) && U16_IS_LEAD(input[b - 1])) b++;
+    scan.bounds[k] = b;
+  }
+  scan.bounds[scan.nchunks] = inputlen + 1; /* an empty match may start at the end */
+
+  if (scan.nchunks > 1) {
+    if (nthreads > scan.nchunks) nthreads = (unsigned int)scan.nchunks;
+    workers = MEM_ALLOC(&prog->alloc, nthreads * sizeof(pthread_t));
+    for (; workers && started < nthreads; ++started) {
+      if (pthread_create(&workers[started], NULL, scan_worker, &scan)) break;
+    }
+    if (!started) scan_worker(&scan);
+    for (i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+    if (workers) MEM_FREE(&prog->alloc, workers);
+  }
+
+  if (scan.nomem || !matcher_open(&matcher, prog, &lastgen)) {
+    count = RGX_EXEC_FAILED;
+    *outcome = RGX_OUT_OF_MEMORY;
+    goto release_spans;
+  }
+  if (scan.stop) {
+    count = RGX_EXEC_FAILED;
+    *outcome = scan.stop;
+    goto close_matcher;
+  }
+  if (limits) matcher.budget = &budget; /* the workers had copies */
+  for (k = 0; k < scan.nchunks; ++k) {
+    struct spanlist_s * l = &scan.spans[k];
+    size_t limit = scan.bounds[k + 1];
+    if (e >= limit) continue;
+    j = 0;
+    for (;;) {
+      size_t origin;
+      while (j < l->len && l->buf[j].start < e) ++j;
+      origin = (j < l->len) ? l->buf[j].origin :
+               l->len ? span_next(&scan, l->buf[l->len - 1].start, l->buf[l->len - 1].end) :
+               (scan.nchunks > 1 ? scan.bounds[k] : limit);
+      if (origin <= e) { /* lined up; the rest of the chunk is right */
+        for (; j < l->len; ++j, ++count) {
+          if (count < maxspans) {
+            spans[count * 2] = (UChar*)input + l->buf[j].start;
+            spans[count * 2 + 1] = (UChar*)input + l->buf[j].end;
+          }
+          e = span_next(&scan, l->buf[j].start, l->buf[j].end);
+        }
+        break;
+      }
+      if (!scan_search(&matcher, &scan, e, limit, &start, &end)) break;
+      if (count < maxspans) {
+        spans[count * 2] = (UChar*)input + start;
+        spans[count * 2 + 1] = (UChar*)input + end;
+      }
+      count++;
+      e = span_next(&scan, start, end);
+    }
+    if (matcher.nomem || (limits && budget.stop)) break;
+    if (e < limit) e = limit; /* nothing else starts in this chunk */
+  }
+  if (matcher.nomem || (limits && budget.stop)) {
+    *outcome = matcher.nomem ? RGX_OUT_OF_MEMORY : budget.stop;
+    count = RGX_EXEC_FAILED;
+  } else {
+    *outcome = count ? RGX_MATCH : RGX_NO_MATCH;
+  }
+close_matcher:
+  matcher_close(&matcher);
+release_spans:
+  for (k = 0; k < scan.nchunks; ++k) {
+    if (scan.spans[k].buf) MEM_FREE(&prog->alloc, scan.spans[k].buf);
+  }
+  MEM_FREE(&prog->alloc, scan.spans);
+  MEM_FREE(&prog->alloc, scan.bounds);
+  tele_done(tele, begin, count && count != RGX_EXEC_FAILED, inputlen);
+  return count;
+}
+
+/* Every non-overlapping match in input, as repeated rgx_exec calls would
+ * find them, using up to nthreads threads (0 for one per processor).
+ * spans gets the start and end of up to maxspans matches. Returns the
+ * number of matches, which may be more than maxspans, or RGX_EXEC_FAILED
+ * if memory ran out.
+ */
+size_t
+rgx_exec_all(rgx_prog * prog, const UChar * input, size_t inputlen,
+             UChar ** spans, size_t maxspans, unsigned int nthreads)
+{
+  rgx_result outcome;
+  return exec_all(prog, input, inputlen, spans, maxspans, nthreads, NULL, &outcome);
+}
+
+/* rgx_exec_all with limits on the whole call, each as in rgx_exec_limited.
+ * Time and depth are kept to on every thread; a step or scratch limit
+ * means one thread does all the searching. Returns RGX_EXEC_FAILED if a
+ * limit was passed or memory ran out, with outcome saying which; else
+ * outcome is RGX_MATCH or RGX_NO_MATCH.
+ */
+size_t
+rgx_exec_all_limited(rgx_prog * prog, const UChar * input, size_t inputlen,
+                     UChar ** spans, size_t maxspans, unsigned int nthreads,
+                     const rgx_limits * limits, rgx_result * outcome)
+{
+  return exec_all(prog, input, inputlen, spans, maxspans, nthreads, limits, outcome);
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+/* The tests.txt runner; left out when regex.c is built as a library. */
+#ifndef RGX_NO_MAIN
+
 #include "bml.h"
-#if 1
-#define REPS 5000
-#else
-#define REPS 1
-#endif
 #define MAXSUB 20
 
 #if 0
@@ -1714,18 +4368,536 @@ readline(void)
   return 1;
 }
 
-void
-timing(void)
+/* The features beyond matching, each against what it should give for a
+ * few known patterns. These run once, after tests.txt.
+ */
+
+static size_t
+utf8_in(UChar * dst, size_t cap, const char * src)
 {
-  UChar * subs[MAXSUB * 2];
-  int i;
-  clock_t start, finish;
-  start = clock();
-  for (i = 0; i < REPS; ++i)
-    rgx_exec(program, input, (size_t)u_strlen(input), subs, rgx_group_count(program) * 2);
-  finish = clock();
-  printf("time: %3d '%s'\n", (int)((finish - start) / REPS), ustr0(pattern));
-  fflush(stdout);
+  UErrorCode uec = U_ZERO_ERROR;
+  int32_t n = 0;
+  u_strFromUTF8(dst, (int32_t)cap, &n, src, -1, &uec);
+  return (size_t)n;
+}
+
+static rgx_prog *
+compile_utf8(const char * rgx)
+{
+  static UChar buf[1024];
+  rgx_prog * prog;
+  size_t len = utf8_in(buf, 1024, rgx);
+  if (rgx_compile(&prog, buf, len) != RGX_OK) {
+    printf("compile error for '%s'\n", rgx);
+    return NULL;
+  }
+  return prog;
+}
+
+/* "fo+" over five inputs, on one thread and on four */
+bool
+batch_test(void)
+{
+  static const char * strs[] = { "foo", "xfooo", "bar", "", "f" };
+  static const bool want[] = { true, true, false, false, false };
+  static const size_t spans[] = { 0, 3, 1, 5 };
+  UChar bufs[5][8];
+  const UChar * inputs[5];
+  size_t lens[5];
+  bool matched[5];
+  UChar * results[5 * 2];
+  rgx_prog * prog = compile_utf8("fo+");
+  unsigned int nthreads;
+  size_t i, n;
+  if (!prog) return true;
+  for (i = 0; i < 5; ++i) { inputs[i] = bufs[i]; lens[i] = utf8_in(bufs[i], 8, strs[i]); }
+  for (nthreads = 1; nthreads <= 4; nthreads += 3) {
+    n = rgx_exec_batch(prog, inputs, lens, 5, matched, results, 2, nthreads);
+    if (n != 2 || memcmp(matched, want, sizeof(want))) goto bad;
+    for (i = 0; i < 2; ++i) {
+      if (results[i * 2] != inputs[i] + spans[i * 2] ||
+          results[i * 2 + 1] != inputs[i] + spans[i * 2 + 1]) goto bad;
+    }
+    for (i = 4; i < 10; ++i) if (results[i]) goto bad;
+  }
+  if (rgx_exec_batch(prog, inputs, lens, 0, matched, results, 2, 4) != 0) goto bad;
+  rgx_free(prog);
+  return false;
+bad:
+  printf("XXX: batch differs on %u threads (%lu matches)\n", nthreads, (unsigned long)n);
+  rgx_free(prog);
+  return true;
+}
+
+/* rgx_exec_with_stats; all zero unless built with -DRGX_STATS */
+#ifdef RGX_STATS
+#define COUNTED(X) (X)
+#else
+#define COUNTED(X) 0
+#endif
+
+struct stats_test_s {
+  const char * rgx;
+  const char * str;
+  size_t steps;
+  size_t peak_threads;
+  size_t procs;
+  size_t dedups;
+};
+
+static const struct stats_test_s stats_tests[] = {
+  /* a step at each of 5 code points and the end; the prefix loop, 'a' and 'b' */
+  { "abc",              "xxabc",  6, 3, 0, 0 },
+  /* the procedure is called at every position, and the 5 calls waiting
+   * to resume after the '!' are one thread */
+  { "(?/p:a*!)\\gp;z",  "aaaa!z", 29, 2, 7, 4 },
+};
+#define stats_tests_length  (sizeof(stats_tests) / sizeof(stats_tests[0]))
+
+bool
+stats_test(const struct stats_test_s * t)
+{
+  UChar str[BUFMAX];
+  rgx_exec_stats st;
+  rgx_prog * prog = compile_utf8(t->rgx);
+  size_t len = utf8_in(str, BUFMAX, t->str);
+  bool bad;
+  if (!prog) return true;
+  st.pcs = NULL;
+  bad = !rgx_exec_with_stats(prog, str, len, NULL, 0, &st) ||
+        st.steps != COUNTED(t->steps) || st.peak_threads != COUNTED(t->peak_threads) ||
+        st.procs != COUNTED(t->procs) || st.dedups != COUNTED(t->dedups);
+  if (bad) {
+    printf("XXX: stats differ '%s', '%s' (%lu steps, %lu peak, %lu procs, %lu dedups)\n",
+           t->rgx, t->str, (unsigned long)st.steps, (unsigned long)st.peak_threads,
+           (unsigned long)st.procs, (unsigned long)st.dedups);
+  }
+  rgx_free(prog);
+  return bad;
+}
+
+/* per-pc counts: "a*b" is 5 char 'a' and 7 char 'b', after the prefix loop */
+bool
+pc_stats_test(void)
+{
+  UChar str[8];
+  rgx_exec_stats st;
+  rgx_prog * prog = compile_utf8("a*b");
+  size_t len = utf8_in(str, 8, "aaab");
+  bool bad;
+  if (!prog) return true;
+  st.pcs = calloc(rgx_prog_length(prog), sizeof(rgx_pc_stats));
+  bad = !st.pcs || !rgx_exec_with_stats(prog, str, len, NULL, 0, &st) ||
+        st.pcs[5].consumed != COUNTED(3u) || st.pcs[7].consumed != COUNTED(1u) ||
+        st.pcs[7].dropped != COUNTED(3u);
+  if (bad) {
+    printf("XXX: pc stats differ 'a*b', 'aaab'\n");
+    if (st.pcs) rgx_print_prog_stats(prog, st.pcs);
+  }
+  free(st.pcs);
+  rgx_free(prog);
+  return bad;
+}
+
+/* rgx_exec_limited: each limit, just passed and just kept to */
+struct limits_test_s {
+  const char * rgx;
+  const char * str; /* null for 1000 'a's */
+  rgx_limits limits;
+  rgx_result result;
+};
+
+static const struct limits_test_s limits_tests[] = {
+  { "a*b",           "aaab", { 4, 0, 0, 0 },           RGX_STEP_LIMIT },
+  { "a*b",           "aaab", { 5, 0, 0, 0 },           RGX_MATCH },
+  /* the clock is only read every 256 steps */
+  { "a*b",           "aaab", { 0, 1, 0, 0 },           RGX_MATCH },
+  { "a*b",           NULL,   { 0, 1, 0, 0 },           RGX_TIME_LIMIT },
+  { "a*b",           NULL,   { 0, 10000000000u, 0, 0 }, RGX_NO_MATCH },
+  { "a*b",           "aaab", { 0, 0, 1, 0 },           RGX_SCRATCH_LIMIT },
+  { "a*b",           "aaab", { 0, 0, 1u << 20, 0 },    RGX_MATCH },
+  { "(?=a(?=a*b))a", "aab",  { 0, 0, 0, 1 },           RGX_DEPTH_LIMIT },
+  { "(?=a(?=a*b))a", "aab",  { 0, 0, 0, 2 },           RGX_MATCH },
+};
+#define limits_tests_length  (sizeof(limits_tests) / sizeof(limits_tests[0]))
+
+bool
+limits_test(const struct limits_test_s * t)
+{
+  static UChar str[1000];
+  rgx_prog * prog = compile_utf8(t->rgx);
+  size_t len, i;
+  rgx_result r;
+  if (!prog) return true;
+  if (t->str) len = utf8_in(str, 1000, t->str);
+  else for (len = 0; len < 1000; ++len) str[len] = 'a';
+  r = rgx_exec_limited(prog, str, len, NULL, 0, &t->limits);
+  rgx_free(prog);
+  if (r == t->result) return false;
+  printf("XXX: limited match differs '%s', '%s' (%d, not %d) {", t->rgx,
+         t->str ? t->str : "a...", (int)r, (int)t->result);
+  for (i = 0; i < 4; ++i) {
+    static const char * names[] = { "steps", "time_ns", "scratch", "depth" };
+    unsigned long v = (unsigned long)(i == 0 ? t->limits.steps : i == 1 ? t->limits.time_ns :
+                                      i == 2 ? t->limits.scratch : t->limits.depth);
+    if (v) printf(" %s=%lu", names[i], v);
+  }
+  printf(" }\n");
+  return true;
+}
+
+/* rgx_exec_batch_limited: each input has its own budget, on one thread or
+ * four */
+bool
+batch_limits_test(void)
+{
+  static const char * strs[4] = { "aaab", "ab", "aaaaaaab", "c" };
+  static const rgx_result want[4] = { RGX_STEP_LIMIT, RGX_MATCH, RGX_STEP_LIMIT, RGX_NO_MATCH };
+  UChar bufs[4][16];
+  const UChar * inputs[4];
+  size_t lens[4];
+  rgx_result outcomes[4];
+  UChar * results[8];
+  rgx_limits limits = { 4, 0, 0, 0 };
+  rgx_prog * prog = compile_utf8("a*b");
+  unsigned int nthreads;
+  size_t i, n;
+  if (!prog) return true;
+  for (i = 0; i < 4; ++i) {
+    lens[i] = utf8_in(bufs[i], 16, strs[i]);
+    inputs[i] = bufs[i];
+  }
+  for (nthreads = 1; nthreads <= 4; nthreads += 3) {
+    n = rgx_exec_batch_limited(prog, inputs, lens, 4, outcomes, results, 2, nthreads, &limits);
+    for (i = 0; i < 4; ++i) {
+      if (outcomes[i] != want[i] || (want[i] != RGX_MATCH && results[i * 2])) break;
+    }
+    if (n != 1 || i < 4 || results[2] != inputs[1] || results[3] != inputs[1] + 2) {
+      printf("XXX: limited batch differs on %u threads (%u matches)\n", nthreads, (unsigned)n);
+      rgx_free(prog);
+      return true;
+    }
+  }
+  rgx_free(prog);
+  return false;
+}
+
+/* rgx_exec_all_limited: one budget for the call, kept to by every thread */
+struct all_limits_test_s {
+  const char * rgx;
+  rgx_limits limits;
+  rgx_result result;
+  size_t count;      /* of matches in ALLLEN 'a's, if it gets that far */
+};
+
+#define ALLLEN  (4 * RGX_SCAN_CHUNK)
+
+static const struct all_limits_test_s all_limits_tests[] = {
+  { "a",                { 100, 0, 0, 0 },          RGX_STEP_LIMIT,    0 },
+  { "a",                { 1u << 20, 0, 0, 0 },     RGX_MATCH,         ALLLEN },
+  { "a",                { 0, 0, 1, 0 },            RGX_SCRATCH_LIMIT, 0 },
+  { "a",                { 0, 1, 0, 0 },            RGX_TIME_LIMIT,    0 },
+  { "a",                { 0, 10000000000u, 0, 0 }, RGX_MATCH,         ALLLEN },
+  { "(?=a(?=a{2,3}))a", { 0, 0, 0, 1 },            RGX_DEPTH_LIMIT,   0 },
+  { "(?=a(?=a{2,3}))a", { 0, 0, 0, 2 },            RGX_MATCH,         ALLLEN - 2 },
+  { "b",                { 0, 0, 0, 1 },            RGX_NO_MATCH,      0 },
+};
+#define all_limits_tests_length  (sizeof(all_limits_tests) / sizeof(all_limits_tests[0]))
+
+bool
+all_limits_test(const struct all_limits_test_s * t)
+{
+  static UChar str[ALLLEN];
+  rgx_prog * prog = compile_utf8(t->rgx);
+  rgx_result r;
+  size_t i, n;
+  if (!prog) return true;
+  for (i = 0; i < ALLLEN; ++i) str[i] = 'a';
+  n = rgx_exec_all_limited(prog, str, ALLLEN, NULL, 0, 4, &t->limits, &r);
+  rgx_free(prog);
+  if (r == t->result && n == (t->count || r == RGX_NO_MATCH ? t->count : RGX_EXEC_FAILED))
+    return false;
+  printf("XXX: limited scan differs '%s' (%d, not %d; %lu matches)\n", t->rgx, (int)r,
+         (int)t->result, (unsigned long)n);
+  return true;
+}
+
+/* each kind of call counts once, with its input; a sample of 2 times half */
+bool
+telemetry_test(void)
+{
+  static UChar * spans[8];
+  UChar strs[3][8];
+  const UChar * inputs[3];
+  size_t lens[3];
+  rgx_telemetry t;
+  rgx_prog * prog = compile_utf8("ab");
+  rgx_prog * other = compile_utf8("cd");
+  size_t i, before = rgx_telemetry_list(NULL, 0);
+  bool bad;
+  if (!prog || !other) return true;
+  lens[0] = utf8_in(strs[0], 8, "xab");
+  lens[1] = utf8_in(strs[1], 8, "xyz");
+  lens[2] = utf8_in(strs[2], 8, "abab");
+  for (i = 0; i < 3; ++i) inputs[i] = strs[i];
+  if (!rgx_telemetry_enable(prog, "ab", 1) || !rgx_telemetry_enable(other, "cd", 2)) return true;
+  rgx_exec(prog, strs[0], lens[0], NULL, 0);           /* 1 execution, 1 match, 3 units */
+  rgx_exec(prog, strs[1], lens[1], NULL, 0);           /* 1, 0, 3 */
+  rgx_exec_all(prog, strs[2], lens[2], spans, 4, 4);   /* 1, 1, 4: two matches, one call */
+  rgx_exec_batch(prog, inputs, lens, 3, NULL, NULL, 0, 2); /* 3, 2, 10 */
+  for (i = 0; i < 4; ++i) rgx_exec(other, strs[0], lens[0], NULL, 0);
+  bad = !rgx_telemetry_get(prog, &t) || t.execs != 6 || t.matches != 4 ||
+        t.bytes != 20 * sizeof(UChar) || t.timed != 6 || t.worst_ns > t.ns ||
+        strcmp(t.name, "ab") || rgx_telemetry_list(NULL, 0) != before + 2;
+  if (!bad) bad = !rgx_telemetry_get(other, &t) || t.execs != 4 || t.matches != 0 ||
+                  t.timed != 2;
+  if (bad) {
+    printf("XXX: telemetry differs '%s' (%lu execs, %lu matches, %lu bytes, %lu timed)\n",
+           t.name, (unsigned long)t.execs, (unsigned long)t.matches, (unsigned long)t.bytes,
+           (unsigned long)t.timed);
+  }
+  rgx_free(prog);
+  rgx_free(other);
+  if (!bad && rgx_telemetry_list(NULL, 0) != before) {
+    printf("XXX: telemetry keeps freed programs\n");
+    bad = true;
+  }
+  return bad;
+}
+
+struct analysis_test_s {
+  const char * rgx;
+  size_t min_len, max_len;
+  size_t look_depth;
+  unsigned int engines;
+  rgx_complexity complexity;
+  size_t degree;
+};
+
+#define PIKE RGX_ENGINE_PIKE
+#define PAR  RGX_ENGINE_PARALLEL
+#define DFA  RGX_ENGINE_DFA
+#define LIT  RGX_ENGINE_LITERAL
+#define UNB  RGX_UNBOUNDED
+
+static const struct analysis_test_s analysis_tests[] = {
+  { "abc",                3, 3,   0, PIKE|PAR|DFA|LIT, RGX_LINEAR, 1 },
+  { "a*b",                1, UNB, 0, PIKE|PAR|DFA, RGX_LINEAR, 1 },
+  { "[ab]c|d",            1, 2,   0, PIKE|PAR|DFA, RGX_LINEAR, 1 },
+  { "a(?=b)",             1, 1,   1, PIKE|PAR, RGX_LINEAR, 1 },
+  { "(?<=ab)c",           1, 1,   1, PIKE|PAR, RGX_LINEAR, 1 },
+  { "(?=a*b)a",           1, 1,   1, PIKE|PAR, RGX_QUADRATIC, 2 },
+  { "(?x:a+){ref x}",     1, UNB, 0, PIKE, RGX_QUADRATIC, 2 },
+  { "(?=.*(?=.*b))a",     1, 1,   2, PIKE|PAR, RGX_POLYNOMIAL, 3 },
+  { "(?/p:a\\gp;b|x)\\gp;", 1, UNB, 0, PIKE|PAR, RGX_RECURSIVE, 0 },
+  { "{balanced}z",        3, UNB, 0, PIKE|PAR, RGX_LINEAR, 1 },
+};
+#define analysis_tests_length  (sizeof(analysis_tests) / sizeof(analysis_tests[0]))
+
+#undef PIKE
+#undef PAR
+#undef DFA
+#undef LIT
+#undef UNB
+
+bool
+analysis_test(const struct analysis_test_s * t)
+{
+  rgx_analysis a;
+  rgx_prog * prog = compile_utf8(t->rgx);
+  bool bad;
+  if (!prog) return true;
+  rgx_analyze(prog, &a);
+  bad = a.opcodes != rgx_prog_length(prog) || a.min_len != t->min_len ||
+        a.max_len != t->max_len || a.look_depth != t->look_depth ||
+        a.engines != t->engines || a.complexity != t->complexity || a.degree != t->degree;
+  if (bad) {
+    printf("XXX: analysis differs '%s' (%lu..%ld, depth %lu, engines %u, complexity %d n^%lu)\n",
+           t->rgx, (unsigned long)a.min_len, (long)a.max_len, (unsigned long)a.look_depth,
+           a.engines, (int)a.complexity, (unsigned long)a.degree);
+  }
+  rgx_free(prog);
+  return bad;
+}
+
+static size_t
+index_utf8(rgx_prog * prog, const char * name)
+{
+  UChar buf[8];
+  utf8_in(buf, 8, name);
+  return rgx_group_index(prog, buf);
+}
+
+/* names find their groups, in the order they're defined, but not procedures */
+bool
+names_test(void)
+{
+  static char rgx[1024];
+  rgx_prog * prog;
+  size_t i, n = 0;
+  bool bad = false;
+  if (!(prog = compile_utf8("(?a:x)(?/p:y)(?b:\\gp;)"))) return true;
+  if (rgx_group_count(prog) != 3 || index_utf8(prog, "") != 0 || index_utf8(prog, "a") != 1 ||
+      index_utf8(prog, "b") != 2 || index_utf8(prog, "p") != RGX_NO_GROUP) bad = true;
+  rgx_free(prog);
+  /* enough to grow the table */
+  for (i = 0; i < 40; ++i) n += (size_t)sprintf(rgx + n, "(?g%lu:a)", (unsigned long)i);
+  if (!(prog = compile_utf8(rgx))) return true;
+  for (i = 0; i < 40 && !bad; ++i) {
+    char g[8];
+    sprintf(g, "g%lu", (unsigned long)i);
+    if (index_utf8(prog, g) != i + 1) bad = true;
+  }
+  if (bad) printf("XXX: group index differs\n");
+  rgx_free(prog);
+  return bad;
+}
+
+struct required_test_s {
+  const char * rgx;
+  const char * lit;
+};
+
+static const struct required_test_s required_tests[] = {
+  { "foo\\d+bar",          "foo" },
+  { "\\w+@example\\.com",  "@example.com" },
+  { "abc?d",               "ab" },
+  { "x(abc)*yz",           "yz" },    /* not an optional repeat */
+  { "ab(cd)+e",            "ab" },    /* nor a required one's neighbours */
+  { "x(?=abcd)y",          "x" },     /* nor a look-ahead */
+  { "t\xC3\xA9\xE2\x82\xACst",  "t\xC3\xA9\xE2\x82\xACst" },
+  { "a|b",                 "" },
+};
+#define required_tests_length  (sizeof(required_tests) / sizeof(required_tests[0]))
+
+bool
+required_test(const struct required_test_s * t)
+{
+  UChar want[32];
+  size_t len, wantlen = utf8_in(want, 32, t->lit);
+  rgx_prog * prog = compile_utf8(t->rgx);
+  const UChar * lit;
+  bool bad;
+  if (!prog) return true;
+  lit = rgx_required_literal(prog, &len);
+  bad = len != wantlen || u_memcmp(lit, want, (int32_t)len) || lit[len] != 0;
+  if (bad) printf("XXX: required literal differs '%s' ('%s', not '%s')\n", t->rgx, ustr0(lit),
+                  t->lit);
+  rgx_free(prog);
+  return bad;
+}
+
+/* counts what's live, to see rgx_free give everything back */
+struct counted_s {
+  long live;
+  long calls;
+};
+
+static void *
+count_alloc(void * userdata, size_t size)
+{
+  ((struct counted_s *)userdata)->live++;
+  ((struct counted_s *)userdata)->calls++;
+  return malloc(size);
+}
+
+static void *
+count_resize(void * userdata, void * ptr, size_t size)
+{
+  if (!ptr) ((struct counted_s *)userdata)->live++;
+  ((struct counted_s *)userdata)->calls++;
+  return realloc(ptr, size);
+}
+
+static void
+count_release(void * userdata, void * ptr)
+{
+  ((struct counted_s *)userdata)->live--;
+  free(ptr);
+}
+
+/* a program from its own allocator uses it to match and for its
+ * telemetry, gives back what matching took, and all of it when freed */
+bool
+allocator_test(void)
+{
+  struct counted_s c = { 0, 0 };
+  rgx_allocator a = { count_alloc, count_resize, count_release, &c };
+  UChar pat[16], str[16];
+  size_t patlen = utf8_in(pat, 16, "(?x:a+)b{ref x}");
+  size_t len = utf8_in(str, 16, "xaabaa");
+  UChar * subs[4];
+  rgx_prog * prog = NULL;
+  long live, calls;
+  bool m;
+  if (rgx_compile_with(&prog, pat, patlen, &a) != RGX_OK) goto bad;
+  live = c.live;
+  calls = c.calls;
+  m = rgx_exec(prog, str, len, subs, 4);
+  if (!m || subs[0] != str + 1 || subs[1] != str + 6 || live <= 0 || c.live != live ||
+      c.calls == calls) goto bad;
+  if (!rgx_telemetry_enable(prog, "counted", 1) || c.live != live + 1) goto bad;
+  rgx_free(prog);
+  prog = NULL;
+  if (c.live != 0) goto bad;
+  return false;
+bad:
+  printf("XXX: owned program differs (%ld live, %ld calls)\n", c.live, c.calls);
+  if (prog) rgx_free(prog);
+  return true;
+}
+
+/* rgx_exec_all over SCANLEN units of 'x', with a few pieces put in: on 4
+ * threads that's cut into RGX_SCAN_CHUNK chunks, at 16K, 32K and 48K */
+#define SCANLEN (64*1024)
+struct scan_test_s {
+  const char * rgx;
+  size_t at[2];
+  const char * put[2];
+  size_t count;      /* matches */
+  size_t start, end; /* the first one */
+};
+
+static const struct scan_test_s scan_tests[] = {
+  /* a match running over a boundary, and one the next chunk finds inside it */
+  { "[ac][^b]*b", { 16000, 16500 }, { "a", "cxxb" }, 1, 16000, 16504 },
+  { "ab",         { 32767 },        { "ab" },        1, 32767, 32769 },
+  { "b",          { 32767 },        { "ab" },        1, 32768, 32769 },
+  /* a surrogate pair cut by a boundary belongs to the chunk before */
+  { "[^x]",       { 16383 },        { "\xF0\x9F\x98\x80" }, 1, 16383, 16385 },
+  { "x*",         { 16383 },        { "\xF0\x9F\x98\x80" }, 4, 0, 16383 },
+  /* back-references are searched in one piece */
+  { "(?c:[ab]){ref c}", { 16383, 40000 }, { "aa", "bb" }, 2, 16383, 16385 },
+};
+#define scan_tests_length  (sizeof(scan_tests) / sizeof(scan_tests[0]))
+
+bool
+scan_test(const struct scan_test_s * t)
+{
+  static UChar big[SCANLEN];
+  static UChar * spans1[SCANLEN * 2];
+  static UChar * spans4[SCANLEN * 2];
+  rgx_prog * prog = compile_utf8(t->rgx);
+  size_t i, n1, n4;
+  bool bad;
+  if (!prog) return true;
+  for (i = 0; i < SCANLEN; ++i) big[i] = 'x';
+  for (i = 0; i < 2 && t->put[i]; ++i) {
+    UChar piece[16];
+    u_memcpy(big + t->at[i], piece, (int32_t)utf8_in(piece, 16, t->put[i]));
+  }
+  n1 = rgx_exec_all(prog, big, SCANLEN, spans1, SCANLEN, 1);
+  n4 = rgx_exec_all(prog, big, SCANLEN, spans4, SCANLEN, 4);
+  bad = n1 != t->count || n4 != t->count ||
+        (size_t)(spans4[0] - big) != t->start || (size_t)(spans4[1] - big) != t->end ||
+        memcmp(spans1, spans4, n1 * 2 * sizeof(UChar*));
+  if (bad) {
+    printf("XXX: scan differs '%s' (%lu, %lu matches, first %ld..%ld)\n", t->rgx,
+           (unsigned long)n1, (unsigned long)n4, n4 ? (long)(spans4[0] - big) : -1L,
+           n4 ? (long)(spans4[1] - big) : -1L);
+  }
+  rgx_free(prog);
+  return bad;
 }
 
 bool
@@ -1734,28 +4906,32 @@ maybe_report(UChar ** subs)
   /* only report if any; report all if any */
   UChar ** names = rgx_group_names(program);
   size_t nlen = rgx_group_count(program);
+  bool expected[MAXSUB];
   size_t i, j;
   bool report = false;
 start:;
   if (report) printf("XXX: wrong match '%s', '%s'\n", ustr0(pattern), ustr1(input));
 
+  memset(expected, 0, sizeof(expected));
+  for (i = 0; i < matcheslen; ++i) {
+    UChar * a, * b = matches[i * 2 + 1];
+    size_t an, bn = (size_t)u_strlen(b);
+    if ((j = rgx_group_index(program, matches[i * 2])) == RGX_NO_GROUP) continue;
+    if (expected[j]) continue; /* first one wins */
+    expected[j] = true;
+    a = subs[j * 2];
+    an = (size_t)(subs[j * 2 + 1] - a);
+    if (!a || an != bn || u_memcmp(a, b, (int32_t)an)) {
+      if (!report) { report = true; goto start; }
+      printf("  bad match '%s': '%.*s' should be '%s'\n", ustr0(names[j]), (int)an, ustr1(a), ustr2(b));
+    } else if (report) {
+      printf("  good match '%s': '%.*s' is '%s'\n", ustr0(names[j]), (int)an, ustr1(a), ustr2(b));
+    }
+  }
   for (j = 0; j < nlen; ++j) {
     UChar * a = subs[j * 2];
     size_t an = (size_t)(subs[j * 2 + 1] - a);
-    for (i = 0; i < matcheslen; ++i) {
-      if (!u_strcmp(matches[i * 2], names[j])) {
-        UChar * b = matches[i * 2 + 1];
-        size_t bn = (size_t)u_strlen(b);
-        if (!a || an != bn || u_memcmp(a, b, (int32_t)an)) {
-          if (!report) { report = true; goto start; }
-          printf("  bad match '%s': '%.*s' should be '%s'\n", ustr0(names[j]), (int)an, ustr1(a), ustr2(b));
-        } else if (report) {
-          printf("  good match '%s': '%.*s' is '%s'\n", ustr0(names[j]), (int)an, ustr1(a), ustr2(b));
-        }
-        break;
-      }
-    }
-    if (i >= matcheslen && subs[j * 2] != NULL) {
+    if (!expected[j] && a != NULL) {
       if (!report) { report = true; goto start; }
       printf("  bad match '%s': '%.*s' should have failed\n", ustr0(names[j]), (int)an, ustr1(a));
     }
@@ -1767,6 +4943,7 @@ int
 main(void)
 {
   UChar * subs[MAXSUB * 2];
+  size_t i;
   bool m;
 
   signal(SIGSEGV, print_trace);
@@ -1799,13 +4976,30 @@ main(void)
     }
     if (maybe_report(subs)) { goto error; }
 
-    timing(); continue;
+    rgx_free(program);
+    continue;
     error: rgx_print_prog(program);
+    rgx_free(program);
   }
+  for (i = 0; i < scan_tests_length; ++i) scan_test(&scan_tests[i]);
+  for (i = 0; i < stats_tests_length; ++i) stats_test(&stats_tests[i]);
+  for (i = 0; i < limits_tests_length; ++i) limits_test(&limits_tests[i]);
+  batch_limits_test();
+  for (i = 0; i < all_limits_tests_length; ++i) all_limits_test(&all_limits_tests[i]);
+  for (i = 0; i < analysis_tests_length; ++i) analysis_test(&analysis_tests[i]);
+  for (i = 0; i < required_tests_length; ++i) required_test(&required_tests[i]);
+  batch_test();
+  pc_stats_test();
+  telemetry_test();
+  names_test();
+  allocator_test();
+  LOG_COMPILE(rgx_telemetry_dump(stdout, false));
   printf("done\n");
   return 0;
 }
 
+#endif /* RGX_NO_MAIN */
+
 /* ********************************************************************** */
 /* ********************************************************************** */
 /* Portions of this program are derived from re1 by Russ Cox.
@@ -0,0 +1,182 @@
+/* The matcher's public interface; see regex.c and DOCS.html.
+ */
+#ifndef RGX_REGEX_H_
+#define RGX_REGEX_H_ 1
+
+#include <stdio.h>
+#include "icu-payne.h"
+
+typedef enum rgx_error_e {
+  RGX_OK = 0,
+  RGX_MEMORY,          /*  1  malloc failed */
+  RGX_TOO_LONG,        /*  2  regex would compile into too many opcodes */
+  RGX_OVERFLOW,        /*  3  {n,m} integer overflow */
+  RGX_BAD_REPEAT,      /*  4  {n,m} n > m */
+  RGX_BAD_SET,         /*  5  malformed [] */
+  RGX_BAD_DIRECTIVE,   /*  6  malformed {} */
+  RGX_MISSING_BRACE,   /*  7  missing } after { */
+  RGX_BAD_GROUP,       /*  8  unexpected after (? */
+  RGX_MISSING_PAREN,   /*  9  missing ) after ( */
+  RGX_BAD_ESCAPE,      /* 10  malformed \escape sequence */
+  RGX_MISSING_BRACKET, /* 11  missing ] after [ */
+  RGX_BAD_NAME,        /* 12  name too long or missing terminator */
+  RGX_UNDEFINED,       /* 13  name is referenced but not defined */
+  RGX_REDEFINED,       /* 14  procedure has multiple definitions */
+  RGX_EXTRA_JUNK       /* 15  expr<rep><rep> */
+} rgx_error;
+
+typedef struct rgx_prog_s rgx_prog;
+
+/* Where a program's memory comes from, for rgx_compile_with. A program
+ * shared between threads calls it from each of them. Character sets are
+ * the exception: ICU allocates those itself.
+ */
+typedef struct rgx_allocator_s {
+  void * (*alloc)(void * userdata, size_t size);              /* like malloc */
+  void * (*resize)(void * userdata, void * ptr, size_t size); /* like realloc */
+  void   (*release)(void * userdata, void * ptr);             /* like free */
+  void * userdata;
+} rgx_allocator;
+
+/* What happened at one pc, for rgx_print_prog_stats. */
+typedef struct rgx_pc_stats_s {
+  size_t added;       /* threads added here */
+  size_t consumed;    /* ...that consumed a character here (or resumed) */
+  size_t dropped;     /* ...that died here, or were already in the list */
+  uint64_t nested_ns; /* in look-around and procedures started here, nested ones included */
+} rgx_pc_stats;
+
+/* What one match cost. Only counted when regex.c is built with
+ * -DRGX_STATS; otherwise rgx_exec_with_stats leaves it all zero.
+ */
+typedef struct rgx_exec_stats_s {
+  rgx_pc_stats * pcs;   /* in: null, or rgx_prog_length() counters to add to */
+  size_t steps;         /* code points consumed, nested executions included */
+  size_t addthreads;    /* addthread calls */
+  size_t peak_threads;  /* longest thread list */
+  size_t sum_threads;   /* thread list lengths summed over steps; / steps for the mean */
+  size_t sub_news;      /* submatches taken (sub_new) */
+  size_t sub_allocs;    /* ...of which had to be malloc'd */
+  size_t sub_copies;    /* copies made on write (sub_update) */
+  size_t looks;         /* look-around executions */
+  size_t procs;         /* procedure and condition executions */
+  size_t max_depth;     /* deepest nesting of those */
+  size_t resumes;       /* paused threads resumed */
+  size_t dedups;        /* paused threads dropped as repeats of another */
+  size_t peeks;         /* short look-arounds checked in place instead */
+} rgx_exec_stats;
+
+/* Per-call limits for rgx_exec*_limited; zero is no limit. */
+typedef struct rgx_limits_s {
+  size_t steps;      /* code points consumed, nested executions included */
+  uint64_t time_ns;  /* wall-clock time from the call, looked at every 256 steps */
+  size_t scratch;    /* bytes of thread lists and submatches */
+  size_t depth;      /* look-around and procedure executions nested in each other */
+} rgx_limits;
+
+typedef enum rgx_result_e {
+  RGX_NO_MATCH = 0,
+  RGX_MATCH,
+  RGX_STEP_LIMIT,    /* gave up: each of these is a limit passed */
+  RGX_TIME_LIMIT,
+  RGX_SCRATCH_LIMIT,
+  RGX_DEPTH_LIMIT,
+  RGX_OUT_OF_MEMORY  /* malloc failed */
+} rgx_result;
+
+#define RGX_UNBOUNDED ((size_t)-1)
+/* rgx_group_index of a name the pattern doesn't have */
+#define RGX_NO_GROUP ((size_t)-1)
+/* rgx_exec_all and rgx_exec_batch when memory ran out, or rgx_exec_all_limited passed a limit */
+#define RGX_EXEC_FAILED ((size_t)-1)
+
+/* Engines a pattern can run on, in rgx_analysis.engines. */
+typedef enum rgx_engine_e {
+  RGX_ENGINE_PIKE     = 1, /* rgx_exec; any pattern */
+  RGX_ENGINE_PARALLEL = 2, /* rgx_exec_all splits the input: no back-references */
+  RGX_ENGINE_DFA      = 4, /* a plain automaton would do: no look-around, back-references,
+                            * procedures or {balanced} */
+  RGX_ENGINE_LITERAL  = 8  /* one fixed string */
+} rgx_engine;
+
+/* Worst-case time against input length n (times the program length). */
+typedef enum rgx_complexity_e {
+  RGX_LINEAR = 0,  /* O(n) */
+  RGX_QUADRATIC,   /* O(n^2): unbounded look-around or procedure at each position, or back-references */
+  RGX_POLYNOMIAL,  /* O(n^degree): those nested in each other */
+  RGX_RECURSIVE    /* recursive procedures; no bound */
+} rgx_complexity;
+
+/* What a compiled pattern costs, for deciding whether to accept it. */
+typedef struct rgx_analysis_s {
+  size_t opcodes;       /* program length */
+  size_t sets;          /* character sets */
+  size_t bytes;         /* memory held: the program, its sets (estimated) and tries */
+  size_t look_depth;    /* deepest look-around nesting, procedure calls followed */
+  size_t procs;         /* procedures defined */
+  bool recursive;       /* a procedure calls itself, directly or through others */
+  bool backrefs;        /* back-references of any kind */
+  size_t min_len;       /* shortest match, in code points */
+  size_t max_len;       /* longest match, or RGX_UNBOUNDED */
+  unsigned int engines; /* rgx_engine bits */
+  rgx_complexity complexity;
+  size_t degree;        /* n's exponent in the worst case; 0 if RGX_RECURSIVE */
+} rgx_analysis;
+
+/* A snapshot of one pattern's telemetry; see rgx_telemetry_enable. */
+typedef struct rgx_telemetry_s {
+  rgx_prog * prog;
+  char name[64];        /* as registered, cut to fit; a copy, so it outlives rgx_free */
+  unsigned int sample;  /* 1 in this many executions is timed */
+  size_t execs;         /* rgx_exec* calls, or inputs to rgx_exec_batch */
+  size_t matches;       /* ...that matched */
+  size_t bytes;         /* their inputs, each counted once */
+  size_t timed;         /* executions timed */
+  uint64_t ns;          /* time spent in those */
+  uint64_t worst_ns;    /* the slowest of those */
+} rgx_telemetry;
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+extern rgx_error rgx_compile(rgx_prog ** program, const UChar * pattern, size_t patlen);
+extern rgx_error rgx_compile_with(rgx_prog ** program, const UChar * pattern, size_t patlen,
+                                  const rgx_allocator * alloc);
+extern void     rgx_free(rgx_prog * prog);
+extern UChar ** rgx_group_names(rgx_prog * prog);
+extern size_t   rgx_group_count(rgx_prog * prog);
+extern size_t   rgx_group_index(rgx_prog * prog, const UChar * name);
+extern const UChar * rgx_required_literal(rgx_prog * prog, size_t * len);
+extern size_t   rgx_prog_length(rgx_prog * prog);
+extern void     rgx_print_prog(rgx_prog * prog);
+extern void     rgx_print_prog_stats(rgx_prog * prog, const rgx_pc_stats * pcs);
+extern void     rgx_analyze(rgx_prog * prog, rgx_analysis * out);
+
+extern bool   rgx_exec(rgx_prog * prog, const UChar * input, size_t inputlen,
+                       UChar ** subp, size_t nsubp);
+extern bool   rgx_exec_with_stats(rgx_prog * prog, const UChar * input, size_t inputlen,
+                                  UChar ** subp, size_t nsubp, rgx_exec_stats * stats);
+extern rgx_result rgx_exec_limited(rgx_prog * prog, const UChar * input, size_t inputlen,
+                                   UChar ** subp, size_t nsubp, const rgx_limits * limits);
+extern size_t rgx_exec_batch(rgx_prog * prog, const UChar * const * inputs, const size_t * lens,
+                             size_t n, bool * matched, UChar ** results, size_t nsubp,
+                             unsigned int nthreads);
+extern size_t rgx_exec_batch_limited(rgx_prog * prog, const UChar * const * inputs,
+                                     const size_t * lens, size_t n, rgx_result * outcomes,
+                                     UChar ** results, size_t nsubp, unsigned int nthreads,
+                                     const rgx_limits * limits);
+extern size_t rgx_exec_all(rgx_prog * prog, const UChar * input, size_t inputlen,
+                           UChar ** spans, size_t maxspans, unsigned int nthreads);
+extern size_t rgx_exec_all_limited(rgx_prog * prog, const UChar * input, size_t inputlen,
+                                   UChar ** spans, size_t maxspans, unsigned int nthreads,
+                                   const rgx_limits * limits, rgx_result * outcome);
+
+extern bool   rgx_telemetry_enable(rgx_prog * prog, const char * name, unsigned int sample);
+extern bool   rgx_telemetry_get(rgx_prog * prog, rgx_telemetry * out);
+extern size_t rgx_telemetry_list(rgx_telemetry * out, size_t max);
+extern bool   rgx_telemetry_dump(FILE * fp, bool json);
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+#endif /* RGX_REGEX_H_ */
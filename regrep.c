@@ -0,0 +1,517 @@
+/* regrep: print the lines that match a pattern, like grep.
+ *
+ *   regrep [-cHhlnv] [-j threads] pattern [file...]
+ *
+ * Files are mapped rather than read. Each file is cut into chunks at line
+ * breaks, and the chunks of every file are shared out between threads;
+ * output is still written in file order.
+ *
+ * Lines are found with memchr (vectorized in any decent libc) and are only
+ * decoded from UTF-8 when the matcher has to look at them. A pattern with
+ * no syntax in it is just a string, and is found with memmem on the raw
+ * bytes without decoding anything. Anything else goes through the matcher,
+ * a few thousand lines at a time.
+ */
+#define _GNU_SOURCE 1 /* memmem */
+#include "regex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CHUNK_BYTES  (4*1024*1024) /* files are cut into chunks about this big */
+#define BATCH_LINES  (4096)        /* lines handed to the matcher at once */
+
+static struct options_s {
+  bool count;     /* -c */
+  bool names;     /* -H, or more than one file */
+  bool list;      /* -l */
+  bool number;    /* -n */
+  bool invert;    /* -v */
+  unsigned int threads;
+} opt;
+
+static rgx_prog * prog;
+static const char * literal; /* the pattern, if it's only a string */
+static size_t literallen;
+static char * required;      /* else a string every matching line has, in UTF-8 */
+static size_t requiredlen;
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+struct file_s {
+  const char * name;
+  const char * data;
+  size_t len;
+  bool mapped;
+};
+
+struct hit_s {
+  size_t off;    /* line start, from the start of the file */
+  size_t len;    /* without the line break */
+  size_t lineno; /* from the start of the chunk, counting from 0 */
+};
+
+struct chunk_s {
+  struct file_s * file;
+  size_t from;
+  size_t to;
+  bool last;     /* the file's last chunk */
+  size_t nlines; /* only counted for -n */
+  struct hit_s * hits;
+  size_t nhits;
+  size_t caphits;
+  bool done;
+};
+
+static struct chunk_s * chunks;
+static size_t nchunks;
+static size_t nextchunk; /* atomic */
+static pthread_mutex_t donelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;
+
+static void
+hit_push(struct chunk_s * ck, size_t off, size_t len, size_t lineno)
+{
+  if (ck->nhits >= ck->caphits) {
+    ck->caphits = ck->caphits ? ck->caphits * 2 : 64;
+    ck->hits = realloc(ck->hits, ck->caphits * sizeof(struct hit_s));
+    if (!ck->hits) { perror("regrep"); exit(2); }
+  }
+  ck->hits[ck->nhits].off = off;
+  ck->hits[ck->nhits].len = len;
+  ck->hits[ck->nhits].lineno = lineno;
+  ck->nhits++;
+}
+
+static size_t
+count_lines(const char * p, const char * end)
+{
+  size_t n = 0;
+  while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) { n++; p++; }
+  return n;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+/* per-thread buffers for decoded lines */
+struct scratch_s {
+  UChar * text;
+  size_t textlen;
+  size_t textcap;
+  const UChar * inputs[BATCH_LINES];
+  size_t lens[BATCH_LINES];
+  size_t starts[BATCH_LINES]; /* into text; it may move while filling */
+  bool matched[BATCH_LINES];
+  bool skip[BATCH_LINES];     /* can't match; only here to keep the output in order */
+  struct hit_s lines[BATCH_LINES];
+  size_t n;
+};
+
+static void
+batch_flush(struct chunk_s * ck, struct scratch_s * sc)
+{
+  size_t i, k = 0;
+  for (i = 0; i < sc->n; ++i) { /* the lines to match, packed to the front */
+    if (sc->skip[i]) continue;
+    sc->inputs[k] = sc->text + sc->starts[i];
+    sc->lens[k++] = sc->lens[i];
+  }
+  if (k && rgx_exec_batch(prog, sc->inputs, sc->lens, k, sc->matched, NULL, 0, 1)
+           == RGX_EXEC_FAILED) {
+    fprintf(stderr, "regrep: out of memory\n");
+    exit(2);
+  }
+  for (i = 0, k = 0; i < sc->n; ++i) {
+    bool m = !sc->skip[i] && sc->matched[k++];
+    if (m != opt.invert) hit_push(ck, sc->lines[i].off, sc->lines[i].len, sc->lines[i].lineno);
+  }
+  sc->n = 0;
+  sc->textlen = 0;
+}
+
+static void
+batch_add(struct chunk_s * ck, struct scratch_s * sc, size_t off, size_t len, size_t lineno,
+          bool skip)
+{
+  UErrorCode uec = U_ZERO_ERROR;
+  int32_t n = 0;
+  sc->skip[sc->n] = skip;
+  sc->lines[sc->n].off = off;
+  sc->lines[sc->n].len = len;
+  sc->lines[sc->n].lineno = lineno;
+  if (skip) {
+    if (++sc->n >= BATCH_LINES) batch_flush(ck, sc);
+    return;
+  }
+  if (sc->textcap - sc->textlen < len + 1) { /* UTF-16 is never longer than UTF-8 */
+    sc->textcap = (sc->textlen + len + 1) * 2;
+    sc->text = realloc(sc->text, sc->textcap * sizeof(UChar));
+    if (!sc->text) { perror("regrep"); exit(2); }
+  }
+  u_strFromUTF8WithSub(sc->text + sc->textlen, (int32_t)(sc->textcap - sc->textlen), &n,
+                       ck->file->data + off, (int32_t)len, 0xFFFD, NULL, &uec);
+  sc->starts[sc->n] = sc->textlen;
+  sc->lens[sc->n] = (size_t)n;
+  sc->textlen += (size_t)n;
+  if (++sc->n >= BATCH_LINES) batch_flush(ck, sc);
+}
+
+/* a literal without -v: find it in the whole chunk, then the line round it */
+static void
+scan_literal(struct chunk_s * ck)
+{
+  const char * data = ck->file->data;
+  const char * p = data + ck->from;
+  const char * end = data + ck->to;
+  const char * counted = p;
+  size_t lineno = 0;
+  const char * hit;
+
+  while (p < end && (hit = memmem(p, (size_t)(end - p), literal, literallen)) != NULL) {
+    const char * ls = hit;
+    const char * le = memchr(hit, '\n', (size_t)(end - hit));
+    if (!le) le = end;
+    while (ls > p && ls[-1] != '\n') ls--;
+    if (opt.number) { lineno += count_lines(counted, ls); counted = ls; }
+    hit_push(ck, (size_t)(ls - data), (size_t)(le - ls), lineno);
+    p = le + 1;
+  }
+  if (opt.number) ck->nlines = lineno + count_lines(counted, end);
+}
+
+/* Without -v, only lines holding the required string can match: find it
+ * in the whole chunk, and decode and match just the lines round it.
+ */
+static void
+scan_required(struct chunk_s * ck, struct scratch_s * sc)
+{
+  const char * data = ck->file->data;
+  const char * p = data + ck->from;
+  const char * end = data + ck->to;
+  const char * counted = p;
+  size_t lineno = 0;
+  const char * hit;
+
+  while (p < end && (hit = memmem(p, (size_t)(end - p), required, requiredlen)) != NULL) {
+    const char * ls = hit;
+    const char * le = memchr(hit, '\n', (size_t)(end - hit));
+    if (!le) le = end;
+    while (ls > p && ls[-1] != '\n') ls--;
+    if (opt.number) { lineno += count_lines(counted, ls); counted = ls; }
+    batch_add(ck, sc, (size_t)(ls - data), (size_t)(le - ls), lineno, false);
+    p = le + 1;
+  }
+  if (sc->n) batch_flush(ck, sc);
+  if (opt.number) ck->nlines = lineno + count_lines(counted, end);
+}
+
+static void
+scan_chunk(struct chunk_s * ck, struct scratch_s * sc)
+{
+  const char * data = ck->file->data;
+  const char * p = data + ck->from;
+  const char * end = data + ck->to;
+  size_t lineno = 0;
+
+  if (literal && !opt.invert) { scan_literal(ck); return; }
+  if (required && !opt.invert) { scan_required(ck, sc); return; }
+
+  while (p < end) {
+    const char * le = memchr(p, '\n', (size_t)(end - p));
+    size_t len = (size_t)((le ? le : end) - p);
+    if (literal) {
+      bool m = memmem(p, len, literal, literallen) != NULL;
+      if (m != opt.invert) hit_push(ck, (size_t)(p - data), len, lineno);
+    } else {
+      bool skip = required && !memmem(p, len, required, requiredlen); /* only with -v */
+      batch_add(ck, sc, (size_t)(p - data), len, lineno, skip);
+    }
+    lineno++;
+    if (!le) break;
+    p = le + 1;
+  }
+  if (sc->n) batch_flush(ck, sc);
+  ck->nlines = lineno;
+}
+
+static void *
+worker(void * arg)
+{
+  struct scratch_s * sc = calloc(1, sizeof(struct scratch_s));
+  size_t k;
+  (void)arg;
+  if (!sc) { perror("regrep"); exit(2); }
+  while ((k = __atomic_fetch_add(&nextchunk, 1, __ATOMIC_RELAXED)) < nchunks) {
+    scan_chunk(&chunks[k], sc);
+    pthread_mutex_lock(&donelock);
+    chunks[k].done = true;
+    pthread_cond_broadcast(&donecond);
+    pthread_mutex_unlock(&donelock);
+  }
+  free(sc->text);
+  free(sc);
+  return NULL;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+static bool
+open_file(struct file_s * f, const char * name)
+{
+  struct stat st;
+  int fd;
+  f->name = name;
+  f->data = NULL;
+  f->len = 0;
+  f->mapped = false;
+
+  if (!strcmp(name, "-")) { /* stdin can't be mapped; read it all */
+    size_t cap = 0;
+    char * buf = NULL;
+    ssize_t n;
+    f->name = "(standard input)";
+    for (;;) {
+      if (f->len == cap) {
+        cap = cap ? cap * 2 : 65536;
+        if (!(buf = realloc(buf, cap))) return false;
+      }
+      n = read(0, buf + f->len, cap - f->len);
+      if (n < 0) { free(buf); return false; }
+      if (n == 0) break;
+      f->len += (size_t)n;
+    }
+    f->data = buf;
+    return true;
+  }
+
+  if ((fd = open(name, O_RDONLY)) < 0) return false;
+  if (fstat(fd, &st) < 0) { close(fd); return false; }
+  f->len = (size_t)st.st_size;
+  if (f->len) {
+    void * p = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) { close(fd); return false; }
+    madvise(p, f->len, MADV_SEQUENTIAL);
+    f->data = p;
+    f->mapped = true;
+  }
+  close(fd);
+  return true;
+}
+
+static void
+close_file(struct file_s * f)
+{
+  if (f->mapped) munmap((void *)f->data, f->len);
+  else free((void *)f->data);
+}
+
+/* cut a file into chunks that end just after a line break */
+static void
+add_chunks(struct file_s * f)
+{
+  size_t from = 0;
+  do {
+    size_t to = from + CHUNK_BYTES;
+    if (to >= f->len) {
+      to = f->len;
+    } else {
+      const char * nl = memchr(f->data + to, '\n', f->len - to);
+      to = nl ? (size_t)(nl - f->data) + 1 : f->len;
+    }
+    chunks = realloc(chunks, (nchunks + 1) * sizeof(struct chunk_s));
+    if (!chunks) { perror("regrep"); exit(2); }
+    memset(&chunks[nchunks], 0, sizeof(struct chunk_s));
+    chunks[nchunks].file = f;
+    chunks[nchunks].from = from;
+    chunks[nchunks].to = to;
+    chunks[nchunks].last = (to >= f->len);
+    nchunks++;
+    from = to;
+  } while (from < f->len);
+}
+
+/* write out the chunks as they're finished, in order */
+static bool
+print_chunks(void)
+{
+  size_t k, i;
+  size_t lineno = 0;
+  size_t count = 0;
+  bool any = false;
+
+  for (k = 0; k < nchunks; ++k) {
+    struct chunk_s * ck = &chunks[k];
+    const char * name = ck->file->name;
+
+    pthread_mutex_lock(&donelock);
+    while (!ck->done) pthread_cond_wait(&donecond, &donelock);
+    pthread_mutex_unlock(&donelock);
+
+    count += ck->nhits;
+    if (!opt.count && !opt.list) {
+      for (i = 0; i < ck->nhits; ++i) {
+        struct hit_s * h = &ck->hits[i];
+        if (opt.names) printf("%s:", name);
+        if (opt.number) printf("%lu:", (unsigned long)(lineno + h->lineno + 1));
+        fwrite(ck->file->data + h->off, 1, h->len, stdout);
+        putchar('\n');
+      }
+    }
+    lineno += ck->nlines;
+    free(ck->hits);
+
+    if (ck->last) {
+      if (opt.count) {
+        if (opt.names) printf("%s:", name);
+        printf("%lu\n", (unsigned long)count);
+      } else if (opt.list && count) {
+        printf("%s\n", name);
+      }
+      if (count) any = true;
+      lineno = 0;
+      count = 0;
+    }
+  }
+  return any;
+}
+
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: regrep [-cHhlnv] [-j threads] pattern [file...]\n");
+  exit(2);
+}
+
+/* nothing in it the pattern syntax would treat specially */
+static bool
+is_literal(const char * s)
+{
+  for (; *s; ++s) {
+    if (strchr("\\^$.|?*+()[]{}#", *s)) return false;
+    if (*s == ' ' || (*s >= '\t' && *s <= '\r')) return false;
+  }
+  return true;
+}
+
+/* The compiled pattern's required literal, in UTF-8 for memmem over the
+ * raw lines. Lines are decoded with U+FFFD for bad bytes, which the raw
+ * bytes wouldn't show, so a literal holding one isn't used.
+ */
+static void
+set_required(void)
+{
+  UErrorCode uec = U_ZERO_ERROR;
+  size_t len, i;
+  int32_t n = 0;
+  const UChar * lit = rgx_required_literal(prog, &len);
+  for (i = 0; i < len; ++i) if (lit[i] == 0xFFFD) return;
+  if (!len) return;
+  u_strToUTF8(NULL, 0, &n, lit, (int32_t)len, &uec);
+  uec = U_ZERO_ERROR;
+  if (!(required = malloc((size_t)n + 1))) return; /* only a shortcut */
+  u_strToUTF8(required, n + 1, NULL, lit, (int32_t)len, &uec);
+  if (U_FAILURE(uec)) { free(required); required = NULL; return; }
+  requiredlen = (size_t)n;
+}
+
+static char stdinname[] = "-";
+static char * stdinnames[] = { stdinname };
+
+int
+main(int argc, char ** argv)
+{
+  struct file_s * files;
+  char ** names;
+  pthread_t * workers;
+  const char * pattern;
+  bool nonames = false;
+  bool any;
+  int status = 0;
+  int nfiles, i, c;
+  unsigned int started = 0, t;
+
+  while ((c = getopt(argc, argv, "cHhlnvj:")) != -1) {
+    switch (c) {
+      case 'c': opt.count = true; break;
+      case 'H': opt.names = true; break;
+      case 'h': nonames = true; break;
+      case 'l': opt.list = true; break;
+      case 'n': opt.number = true; break;
+      case 'v': opt.invert = true; break;
+      case 'j': opt.threads = (unsigned int)atoi(optarg); break;
+      default: usage();
+    }
+  }
+  if (optind >= argc) usage();
+  pattern = argv[optind++];
+
+  {
+    UErrorCode uec = U_ZERO_ERROR;
+    int32_t n = 0;
+    UChar * buf;
+    rgx_error err;
+    u_strFromUTF8(NULL, 0, &n, pattern, -1, &uec);
+    uec = U_ZERO_ERROR;
+    if (!(buf = malloc(((size_t)n + 1) * sizeof(UChar)))) { perror("regrep"); return 2; }
+    u_strFromUTF8(buf, n + 1, NULL, pattern, -1, &uec);
+    if (U_FAILURE(uec)) { fprintf(stderr, "regrep: pattern is not UTF-8\n"); return 2; }
+    if ((err = rgx_compile(&prog, buf, (size_t)n)) != RGX_OK) {
+      fprintf(stderr, "regrep: bad pattern (error %d)\n", (int)err);
+      return 2;
+    }
+    if (is_literal(pattern)) { literal = pattern; literallen = strlen(pattern); }
+    else set_required();
+  }
+
+  names = argv + optind;
+  nfiles = argc - optind;
+  if (nfiles == 0) { names = stdinnames; nfiles = 1; }
+  if (nfiles > 1 && !nonames) opt.names = true;
+  if (nonames) opt.names = false;
+
+  if (!(files = calloc((size_t)nfiles, sizeof(struct file_s)))) { perror("regrep"); return 2; }
+  for (i = 0; i < nfiles; ++i) {
+    if (!open_file(&files[i], names[i])) {
+      fprintf(stderr, "regrep: %s: %s\n", names[i], strerror(errno));
+      status = 2;
+      files[i].name = NULL;
+      continue;
+    }
+    add_chunks(&files[i]);
+  }
+
+  if (opt.threads == 0) {
+    long np = sysconf(_SC_NPROCESSORS_ONLN);
+    opt.threads = np > 0 ? (unsigned int)np : 1;
+  }
+  if (opt.threads > nchunks) opt.threads = nchunks ? (unsigned int)nchunks : 1;
+  if ((workers = malloc(opt.threads * sizeof(pthread_t))) != NULL) {
+    for (; started < opt.threads; ++started) {
+      if (pthread_create(&workers[started], NULL, worker, NULL)) break;
+    }
+  }
+  if (!started) worker(NULL);
+
+  any = print_chunks();
+  for (t = 0; t < started; ++t) pthread_join(workers[t], NULL);
+  free(workers);
+
+  for (i = 0; i < nfiles; ++i) if (files[i].name) close_file(&files[i]);
+  free(files);
+  free(required);
+  free(chunks);
+  fflush(stdout);
+  return status ? status : (any ? 0 : 1);
+}